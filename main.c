@@ -0,0 +1,44 @@
+// See LICENSE for license
+
+// wii-u-gc-adapter: creates an input device for every controller plugged into a Wii U GameCube adapter.
+// All of the work happens in libwiiugc, see wii-u-gc.h.
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <signal.h>
+
+#include "wii-u-gc.h"
+
+static void quitting_signal(int sig)
+{
+   (void)sig;
+   gc_interrupt();
+}
+
+int main(int argc, char *argv[])
+{
+   struct sigaction sa;
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_handler = quitting_signal;
+   sa.sa_flags = SA_RESTART | SA_RESETHAND;
+   sigemptyset(&sa.sa_mask);
+
+   sigaction(SIGINT, &sa, NULL);
+   sigaction(SIGTERM, &sa, NULL);
+
+   int open_ret = gc_open(argc, argv);
+   if (open_ret < 0)
+      return -1;
+   if (open_ret == GC_OPEN_HELP)
+      return 0;
+   if (open_ret == GC_OPEN_BENCHMARK)
+      return gc_run_benchmark();
+
+   // pump events until shutdown & all helper threads finish cleaning up
+   while (gc_dispatch(250))
+      ;
+
+   gc_close();
+   return 0;
+}
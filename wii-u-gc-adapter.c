@@ -1,21 +1,33 @@
 // See LICENSE for license
 
-#define _XOPEN_SOURCE 600
+#define _GNU_SOURCE
 
 #include <time.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <limits.h>
 #include <string.h>
+#include <stdarg.h>
 #include <ctype.h>
 #include <getopt.h>
 
 #include <linux/input.h>
 #include <linux/uinput.h>
+#include <linux/usbdevice_fs.h>
+#include <linux/uhid.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sched.h>
 #include <unistd.h>
 #include <signal.h>
 #include <errno.h>
@@ -24,6 +36,8 @@
 #include <libusb.h>
 #include <pthread.h>
 
+#include "wii-u-gc.h"
+
 #if (!defined(LIBUSBX_API_VERSION) || LIBUSBX_API_VERSION < 0x01000102) && (!defined(LIBUSB_API_VERSION) || LIBUSB_API_VERSION < 0x01000102)
 #error libusb(x) 1.0.16 or higher is required
 #endif
@@ -79,7 +93,7 @@ enum ButtonCodeIndex {
    up_button_index = 15,
 };
 
-const int BUTTON_XBOX_VALUES[16] = {
+static const int BUTTON_XBOX_VALUES[16] = {
    BTN_START,
    BTN_THUMBL,
    BTN_TR2,
@@ -97,7 +111,7 @@ const int BUTTON_XBOX_VALUES[16] = {
    BTN_DPAD_DOWN,
    BTN_DPAD_UP,
 };
-const int BUTTON_LITERAL_VALUES[16] = {
+static const int BUTTON_LITERAL_VALUES[16] = {
    BTN_START,
    BTN_THUMBL,
    BTN_TR2,
@@ -115,7 +129,30 @@ const int BUTTON_LITERAL_VALUES[16] = {
    BTN_DPAD_DOWN,
    BTN_DPAD_UP,
 };
-const int REMAPPED_DPAD_DEFAULTS[4] = {
+// fixed codes of raw mode, one per button bit of the report
+static const int RAW_BUTTON_VALUES[16] = {
+   BTN_START,
+   BTN_Z,
+   BTN_TR2,
+   BTN_TL2,
+   -1,
+   -1,
+   -1,
+   -1,
+   BTN_A,
+   BTN_B,
+   BTN_X,
+   BTN_Y,
+   BTN_DPAD_LEFT,
+   BTN_DPAD_RIGHT,
+   BTN_DPAD_DOWN,
+   BTN_DPAD_UP,
+};
+#define RAW_BUTTON_MASK 0xff0f  // the bits of RAW_BUTTON_VALUES which carry a button
+static const int RAW_AXIS_VALUES[6] = {
+   ABS_X, ABS_Y, ABS_RX, ABS_RY, ABS_Z, ABS_RZ,
+};
+static const int REMAPPED_DPAD_DEFAULTS[4] = {
    BTN_TL,
    BTN_TR,
    BTN_THUMBR,
@@ -187,26 +224,241 @@ struct ff_event
    struct timespec end_time;
 };
 
+// counters are only written by the adapter thread, so a relaxed load and store suffices and readers never see torn values
+#define count_metric(counter, n) __atomic_store_n(&(counter), __atomic_load_n(&(counter), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+#define read_metric(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+/** Per-stage time accounting of the report path, compiled in with "make PROFILE_STAGES=1".
+ *  Ticks are TSC cycles on x86 and CLOCK_MONOTONIC nanoseconds elsewhere, the table converts them to nanoseconds.
+ *  Print the table with SIGUSR1, it is also printed at exit.
+ */
+enum ProfileStage {
+   stage_usb_reap,
+   stage_status,  // state file, connect and disconnect, stream frames
+   stage_buttons,
+   stage_axes,    // without the D-pad modulation
+   stage_dpad,
+   stage_write,
+   stage_ff,      // force feedback read and ioctls
+   stage_rumble,  // rumble evaluation and OUT transfer
+   stage_count,
+};
+
+struct StageProfile {
+   uint64_t calls[stage_count];
+   uint64_t ticks[stage_count];
+};
+
+#ifdef PROFILE_STAGES
+static inline uint64_t profile_now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+   return __builtin_ia32_rdtsc();
+#else
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+#endif
+}
+
+#define PROFILE_BEGIN(name) uint64_t profile_##name = profile_now()
+#define PROFILE_END(profile, stage, name) do { \
+      count_metric((profile).calls[stage], 1); \
+      count_metric((profile).ticks[stage], profile_now() - profile_##name); \
+   } while (0)
+// leaves out the ticks which a nested stage accounted meanwhile
+#define PROFILE_BEGIN_OUTER(profile, name, inner_stage) PROFILE_BEGIN(name); uint64_t profile_##name##_inner = (profile).ticks[inner_stage]
+#define PROFILE_END_OUTER(profile, stage, name, inner_stage) do { \
+      count_metric((profile).calls[stage], 1); \
+      count_metric((profile).ticks[stage], profile_now() - profile_##name - ((profile).ticks[inner_stage] - profile_##name##_inner)); \
+   } while (0)
+#else
+#define PROFILE_BEGIN(name) (void)0
+#define PROFILE_END(profile, stage, name) (void)0
+#define PROFILE_BEGIN_OUTER(profile, name, inner_stage) (void)0
+#define PROFILE_END_OUTER(profile, stage, name, inner_stage) (void)0
+#endif
+
+/** USDT probes of the provider "wiiugc" for bpftrace and perf, compiled in whenever <sys/sdt.h> is installed
+ *  (systemtap-sdt-dev or systemtap-sdt-devel) unless built with "make USDT=0". A probe is a single nop until a tracer
+ *  attaches, list them with "bpftrace -l 'usdt:./wii-u-gc-adapter:*'". The arguments are named in the README.
+ */
+#if !defined(NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_PROBE(name, ...) STAP_PROBEV(wiiugc, name, __VA_ARGS__)
+#endif
+#endif
+#ifndef TRACE_PROBE
+#define TRACE_PROBE(name, ...) (void)0
+#endif
+
+struct PortMetrics {
+   uint64_t events_written;
+   uint64_t writes;
+   uint64_t jitter_events_saved;  // axis changes the jitter filter held back
+   uint64_t jitter_writes_saved;  // reports which needed no write because of it
+   uint64_t ff_uploads;
+   uint64_t ff_erases;
+   uint64_t ff_plays;
+   uint64_t connects;
+   uint64_t disconnects;
+   uint64_t collapsed_reports;  // merged into a later report by --catch-up
+   uint64_t coalesced_reports;  // replaced by a later report before the output tick of --output-rate
+};
+
+// index 0 is unused (success), 1 to 12 are the libusb error codes -1 to -12, the last one counts LIBUSB_ERROR_OTHER
+#define USB_ERROR_CODES 14
+
+static int usb_error_index(int error)
+{
+   return (error < 0 && error > -(USB_ERROR_CODES - 1)) ? -error : USB_ERROR_CODES - 1;
+}
+
+struct AdapterMetrics {
+   uint64_t packets_received;
+   uint64_t packets_dropped;
+   uint64_t idle_reports;  // reports which took the path for empty ports
+   uint64_t rumble_transfers;
+   uint64_t in_timeouts;
+   uint64_t watchdog_expirations;
+   uint64_t clear_halts;
+   uint64_t resets;
+   uint64_t reinits;
+   uint64_t pipeline_overflows;  // reports dropped because the translator thread fell a whole ring behind
+   uint64_t pipeline_depth_max;
+   uint64_t usb_errors[USB_ERROR_CODES];
+};
+
+// hysteresis of an analog input against the dithering of a resting stick, see filter_jitter()
+struct JitterFilter {
+   uint8_t accepted;   // the value which was passed on last
+   uint8_t threshold;  // changes up to this many counts are held back
+   uint8_t block_min, block_max, block_length;  // noise learning
+};
+
+// pulse width filter of a thumbstick axis which is mapped to the D-pad
+struct DeltaModulator {
+   unsigned char unit_duration;  // time duration of a unit of equal return values
+   signed char duty_cycle_units; // keydown to keyup ratio = 1:-n or +n:1, 1 complement, negative values represent duty cycles of keyup
+   unsigned char time;
+};
+
+// what the translation of a port's reports emitted last, every output device of a port has its own
+struct TranslationState {
+   uint16_t buttons;
+   uint8_t axis[6];
+   struct DeltaModulator thumbstick_filter[AXIS_COUNT];
+};
+
+#define MAX_PERSONALITIES 3
+
+// an additional input device of a port, see struct Personality
+struct PersonalityOutput {
+   int uinput;  // -1 if it could not be created
+   struct TranslationState translated;
+   uint64_t events_written;  // not part of the port's metrics, which only cover its main device
+   uint64_t writes;
+};
+
+#define CACHE_LINE_SIZE 64
+#define OUTPUT_BATCH_EVENTS 256  // events one port writes at once, at least max_report_events
+
 struct ports
 {
    bool connected;
+   bool is_adopted;  // handed over by the previous instance, its first report finishes the connect, see start_connected_port()
    bool extra_power;
    int uinput;
+   int uhid;
+   bool uhid_report_sent;
+   unsigned char uhid_report[8];
    unsigned char type;
-   uint16_t buttons;
-   uint8_t axis[6];
+   struct TranslationState translated;
+   struct PersonalityOutput personality_outputs[MAX_PERSONALITIES];
+   struct JitterFilter jitter_filter[AXIS_COUNT];
    struct ff_event ff_events[MAX_FF_EVENTS];
+#ifdef PROFILE_STAGES
+   struct StageProfile profile;
+#endif
+   int64_t output_period_ns;  // 0 writes every report, see coalesce_payload()
+   int64_t next_output_ns;
+   bool has_pending_payload;
+   bool has_held_back_changes;  // by the jitter filter since the last tick
+   unsigned char pending_payload[9];
+   unsigned char emitted_payload[9];
+   struct timespec pending_time;
+   int output_batch_length;
+   struct input_event output_batch[OUTPUT_BATCH_EVENTS];
+   struct GcPortState *state;
+   uint8_t adapter_id;
+   uint8_t port_index;  // 0 to 3
+   unsigned char stream_payload[9];
+   struct PortMetrics metrics;
+};
+
+// how the adapter's endpoints are accessed, the device discovery always uses libusb
+enum UsbBackend {
+   usb_backend_libusb,
+   usb_backend_usbfs,
+   usb_backend_simulated,  // benchmarks only
+};
+
+// stands in for the USB endpoints of an adapter in benchmarks, same contract as libusb_interrupt_transfer()
+struct SimulatedDevice {
+   int (*read_report)(struct SimulatedDevice *device, unsigned char *payload, int length, int *transferred, unsigned int timeout);
+   int (*write_command)(struct SimulatedDevice *device, unsigned char *data, int length, int *transferred, unsigned int timeout);
+};
+
+#define REPORT_RING_SIZE 64  // must be a power of two
+
+struct ReportSlot {
+   struct timespec arrival;  // CLOCK_MONOTONIC_RAW time when the USB thread reaped the report
+   unsigned char payload[37];
+};
+
+/** Hands the reports from the USB thread to the translator thread in pipelined mode, see translator_thread().
+ *  A wait-free single-producer single-consumer ring, each side writes only the cache line of its own index.
+ */
+struct ReportPipeline {
+   pthread_t thread;
+   int eventfd;  // wakes the translator thread
+   uint32_t head __attribute__((aligned(CACHE_LINE_SIZE)));  // written by the USB thread
+   uint32_t tail __attribute__((aligned(CACHE_LINE_SIZE)));  // written by the translator thread
+   int translator_sleeping;
+   uint32_t rumble_request;  // the rumble bytes of the four ports, sent by the USB thread
+   bool has_port_connected;  // lets the USB thread apply the idle interval
+   unsigned char handled_payload[37];  // what the ports were last given by --catch-up, written by the translator thread
+   struct ReportSlot slots[REPORT_RING_SIZE] __attribute__((aligned(CACHE_LINE_SIZE)));
 };
 
+/** Allocated cache line aligned, so that adapter threads never write into a cache line of another adapter.
+ *  The first part is written by the main thread (list, shutdown), the rest only by the adapter's own threads.
+ */
 struct adapter
 {
    volatile bool quitting;
+   volatile bool keeps_outputs;  // the output devices are handed over to a new instance instead of destroyed
    struct libusb_device *device;
    struct libusb_device_handle *handle;
+   enum UsbBackend backend;
+   int usbfs_fd;  // also set with libusb if the handle wraps the device node, see add_adapter_at()
+   uint8_t bus_number;  // 0 for simulated adapters
+   uint8_t device_address;
+   struct SimulatedDevice *simulation;
    pthread_t thread;
+   int id;
+   int state_index;
+   struct adapter *next;
+
+   int64_t last_report_ns __attribute__((aligned(CACHE_LINE_SIZE)));  // CLOCK_MONOTONIC time of the last valid report, for the watchdog
    unsigned char rumble[5];
+   struct AdapterMetrics metrics;
+#ifdef PROFILE_STAGES
+   struct StageProfile profile;  // usb reap and rumble, the ports have their own
+#endif
    struct ports controllers[4];
-   struct adapter *next;
+   struct ReportPipeline pipeline;  // only used with --pipelined
 };
 
 // parsed from command line options
@@ -235,11 +487,77 @@ static enum TriggerMode {
   uses_trigger_right = trigger_normal;
 
 static bool uses_explicit_libusb_claim = false;
+static unsigned int usb_timeout = 100;  // ms, 0 waits forever
+static int watchdog_window = 2000;  // ms, 0 turns the watchdog off
+static int idle_interval = 0;  // ms between reads while no controller is plugged in, 0 reads at the adapter's full rate
+static bool uses_pipeline = false;  // a separate translator thread per adapter
+static bool uses_catch_up = false;  // the translator thread collapses the reports which piled up
+static bool uses_udev_monitor = false;  // finds adapters with a udev monitor even if libusb's hotplug support works
+static int64_t output_periods_ns[4];  // per port, 0 writes the events of every report right away
+static enum UsbBackend usb_backend = usb_backend_libusb;
+static enum OutputBackend {
+   output_backend_uinput,
+   output_backend_uhid,
+   output_backend_null,  // benchmarks only, translates but writes nothing
+   output_backend_none,  // "--no-devices", the ports are only read through the library API
+} output_backend = output_backend_uinput;
 static bool uses_raw_mode = false;
 static bool flips_y_axis = true;
 static bool uses_remapped_dpad = false;
 static bool uses_foreign_buttons = false;
 static bool quits_on_interrupt = false;
+static bool uses_msc_timestamp = false;
+static bool uses_jitter_filter = false;
+static int jitter_thresholds[AXIS_COUNT];  // counts of the raw input, 0 passes every change
+static bool learns_jitter[AXIS_COUNT];      // the threshold follows the noise measured while the input rests
+
+// the mode switches which the translation of a report into input events depends on
+struct TranslationConfig {
+   enum ShoulderButtonMode shoulder_button;
+   enum ThumbstickMode thumbstick_left, thumbstick_right;
+   enum TriggerMode trigger_left, trigger_right;
+   bool flips_y_axis;
+   bool scales_axes;  // any entry of axis_scales is set
+   const int *button_codes;            // BUTTON_COUNT codes, -1 for none
+   const struct AxisCode *axis_codes;  // AXIS_COUNT pairs
+   const struct uinput_user_dev *device_settings;  // the absmin and absmax of the output device
+};
+static struct TranslationConfig translation;  // copied from the options by select_translator()
+
+enum PersonalityKind {
+   personality_xbox,     // BUTTON_XBOX_VALUES, default axes
+   personality_literal,  // BUTTON_LITERAL_VALUES, default axes
+   personality_wheel,    // BUTTON_XBOX_VALUES, the axes of --brake-gas-wheel
+   personality_kinds_count,
+};
+static const char *personality_names[] = { "xbox", "literal", "wheel" };
+
+/** "--personalities" gives every port additional uinput devices, each with a fixed mapping of its own.
+ *  They translate the same filtered report as the main device of the port, see write_personality_events().
+ */
+static struct Personality {
+   const char *name;  // appended to the device name
+   struct TranslationConfig config;  // points to the members below
+   int button_codes[BUTTON_COUNT];
+   struct AxisCode axis_codes[AXIS_COUNT];
+   struct uinput_user_dev device_settings;
+} personalities[MAX_PERSONALITIES];
+static enum PersonalityKind personality_kinds[MAX_PERSONALITIES];
+static int personality_count = 0;
+
+static enum BenchmarkMode {
+   benchmark_none,
+   benchmark_usb,
+   benchmark_shutdown,
+   benchmark_adapters_scaling,
+   benchmark_idle,
+   benchmark_load,
+   benchmark_evdev,
+} benchmark_mode = benchmark_none;
+static int benchmark_seconds = 5;
+static int benchmark_adapters = 8;
+static int benchmark_rate = 1000;  // reports per second of each simulated adapter in the load benchmark
+static bool benchmark_uses_uinput = false;
 #define DEFAULT_Z_CODE BTN_THUMBL
 static int z_code = DEFAULT_Z_CODE;
 
@@ -249,13 +567,33 @@ static struct adapter adapters;
 
 static const char *uinput_path;
 
+static const char *uhid_path = "/dev/uhid";
+
 static uint16_t vendor_id = 0;
 
 static uint16_t product_id = 0;
 
 static const char *device_name = NULL;
 
-enum ControllerId {
+static const char *state_file_path = NULL;
+
+static struct GcStateFile *state_file = NULL;  // without "--state-file" it only lives in this process, for gc_read_port()
+static bool reads_ports = false;  // by gc_enable_port_reads(), otherwise the ports are only published with "--state-file"
+
+static gc_port_callback port_callback = NULL;
+static void *port_callback_data = NULL;
+
+static uint8_t requested_rumble[GC_STATE_MAX_ADAPTERS][4];  // by gc_set_rumble()
+
+static const char *stream_socket_path = NULL;
+
+static const char *handoff_socket_path = NULL;
+
+static const char *metrics_file_path = NULL;
+
+static int metrics_interval = 5;
+
+static enum ControllerId {
    gcn_adapter_index,
    xbox_360_index,
    xbox_360_wireless_index,
@@ -308,7 +646,7 @@ static unsigned char connected_type(unsigned char status)
    }
 }
 
-struct AxisScale {
+static struct AxisScale {
    int end_value;
    int start_value;
    bool uses_start_value;
@@ -360,7 +698,7 @@ static void add_AxisScale(int axis_code, const char descriptor[])
 }
 
 #define AxisName_none_index 7
-const struct AxisName {
+static const struct AxisName {
    const char *name;
    int code;
 } sorted_axis_names[] = {
@@ -570,7 +908,7 @@ static int get_axis_index(const char axis_string[])
    }
 }
 
-const char *axis_names[] = {
+static const char *axis_names[] = {
    "Thumb Left X",
    "Thumb Left Y",
    "Thumb Right X",
@@ -623,8 +961,6 @@ static void set_axes_map(const char mappings_string_[])
 
 static void set_raw_absinfo()
 {
-   uses_raw_mode = true;
-
    int axis_codes[] = {ABS_X, ABS_Y, ABS_RX, ABS_RY, ABS_Z, ABS_RZ, ABS_HAT0X, ABS_HAT0Y, ABS_THROTTLE, ABS_RUDDER, ABS_GAS, ABS_BRAKE, ABS_WHEEL};
    int axes_number = sizeof(axis_codes) / sizeof(axis_codes[0]);
 
@@ -669,82 +1005,347 @@ static void set_axis_absinfo(ptrdiff_t array_offset, const char command_line_set
    free(command_line_settings);
 }
 
-static bool uinput_create(int i, struct ports *port, unsigned char type)
+// SIGINT, SIGTERM and SIGUSR1 have to interrupt the main thread's event loop, so the other threads block them
+static int create_thread(pthread_t *thread, void *(*function)(void *), void *data)
+{
+   sigset_t blocked, previous;
+   sigemptyset(&blocked);
+   sigaddset(&blocked, SIGINT);
+   sigaddset(&blocked, SIGTERM);
+   sigaddset(&blocked, SIGUSR1);
+   pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+   int ret = pthread_create(thread, NULL, function, data);
+   pthread_sigmask(SIG_SETMASK, &previous, NULL);
+   return ret;
+}
+
+static int64_t ts_to_ns(const struct timespec *ts)
+{
+   return (int64_t)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static int64_t clock_ns(clockid_t clock)
+{
+   struct timespec ts = { 0 };
+   clock_gettime(clock, &ts);
+   return ts_to_ns(&ts);
+}
+
+// asynchronous logging: every thread formats its messages into its own ring, a low priority thread writes them to stderr
+
+#define LOG_RING_SIZE 64  // power of two
+#define LOG_MESSAGE_SIZE 192
+
+struct LogRing {
+   uint32_t head;      // written by the owning thread
+   uint32_t tail;      // written by the log thread
+   int abandoned;      // the owning thread exited
+   uint64_t dropped;   // messages lost because the ring was full
+   uint64_t reported_dropped;
+   struct LogRing *next;
+   char messages[LOG_RING_SIZE][LOG_MESSAGE_SIZE];
+};
+
+static struct LogRing *log_rings = NULL;
+static pthread_mutex_t log_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct LogRing *thread_log_ring = NULL;
+static pthread_key_t log_ring_key;
+static bool log_thread_running = false;
+static volatile bool log_quitting = false;
+static pthread_t log_thread;
+static int log_eventfd = -1;
+static int log_sleeping = 0;
+
+static void abandon_log_ring(void *ring)
+{
+   __atomic_store_n(&((struct LogRing*)ring)->abandoned, 1, __ATOMIC_RELEASE);
+}
+
+static struct LogRing *get_thread_log_ring()
+{
+   if (thread_log_ring != NULL)
+      return thread_log_ring;
+
+   struct LogRing *ring = calloc(1, sizeof(struct LogRing));
+   if (ring == NULL)
+      return NULL;
+
+   pthread_mutex_lock(&log_rings_mutex);
+   ring->next = log_rings;
+   log_rings = ring;
+   pthread_mutex_unlock(&log_rings_mutex);
+
+   pthread_setspecific(log_ring_key, ring);
+   thread_log_ring = ring;
+   return ring;
+}
+
+/** Replaces fprintf(stderr, …) on the adapter threads. Never blocks, when the thread's ring is full the message is dropped and counted. */
+static void log_message(const char *format, ...)
+{
+   va_list arguments;
+   va_start(arguments, format);
+
+   struct LogRing *ring = log_thread_running ? get_thread_log_ring() : NULL;
+   if (ring == NULL)
+   {
+      vfprintf(stderr, format, arguments);
+      va_end(arguments);
+      return;
+   }
+
+   uint32_t head = ring->head;
+   if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE)
+   {
+      __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+      va_end(arguments);
+      return;
+   }
+
+   vsnprintf(ring->messages[head & (LOG_RING_SIZE - 1)], LOG_MESSAGE_SIZE, format, arguments);
+   va_end(arguments);
+   __atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+
+   if (__atomic_load_n(&log_sleeping, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&log_sleeping, 0, __ATOMIC_SEQ_CST))
+   {
+      uint64_t one = 1;
+      ssize_t ret = write(log_eventfd, &one, sizeof(one));
+      (void)ret;
+   }
+}
+
+struct LogRateLimit {
+   int64_t window_start_ns;
+   int count;
+   int suppressed;
+};
+
+#define LOG_RATE_LIMIT_BURST 5
+#define LOG_RATE_LIMIT_WINDOW_NS 1000000000LL
+
+// the summary of suppressed messages is written with the first message of the next window
+static bool log_rate_limit_allows(struct LogRateLimit *limit)
 {
-   fprintf(stderr, "connecting on port %d\n", i);
-   port->uinput = open(uinput_path, O_RDWR | O_NONBLOCK);
+   int64_t now_ns = clock_ns(CLOCK_MONOTONIC);
+   int64_t window_start_ns = __atomic_load_n(&limit->window_start_ns, __ATOMIC_RELAXED);
+   if (now_ns - window_start_ns >= LOG_RATE_LIMIT_WINDOW_NS
+      && __atomic_compare_exchange_n(&limit->window_start_ns, &window_start_ns, now_ns, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+   {
+      __atomic_store_n(&limit->count, 0, __ATOMIC_RELAXED);
+      int suppressed = __atomic_exchange_n(&limit->suppressed, 0, __ATOMIC_RELAXED);
+      if (suppressed > 0)
+         log_message("(%d similar messages suppressed)\n", suppressed);
+   }
+
+   if (__atomic_fetch_add(&limit->count, 1, __ATOMIC_RELAXED) < LOG_RATE_LIMIT_BURST)
+      return true;
+
+   __atomic_fetch_add(&limit->suppressed, 1, __ATOMIC_RELAXED);
+   return false;
+}
+
+// at most LOG_RATE_LIMIT_BURST messages per second from each call site
+#define log_ratelimited(...) do { \
+      static struct LogRateLimit log_rate_limit_; \
+      if (log_rate_limit_allows(&log_rate_limit_)) \
+         log_message(__VA_ARGS__); \
+   } while (0)
+
+// returns whether any ring still holds messages
+static bool drain_log_rings()
+{
+   bool pending = false;
+   pthread_mutex_lock(&log_rings_mutex);
+   for (struct LogRing **link = &log_rings; *link != NULL; )
+   {
+      struct LogRing *ring = *link;
+      bool abandoned = __atomic_load_n(&ring->abandoned, __ATOMIC_ACQUIRE);
+      uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+      uint32_t tail = ring->tail;
+
+      for (; tail != head; tail++)
+         fputs(ring->messages[tail & (LOG_RING_SIZE - 1)], stderr);
+      __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+      uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+      if (dropped != ring->reported_dropped)
+      {
+         fprintf(stderr, "(%llu log messages dropped)\n", (unsigned long long)(dropped - ring->reported_dropped));
+         ring->reported_dropped = dropped;
+      }
+
+      if (abandoned)
+      {
+         *link = ring->next;
+         free(ring);
+         continue;
+      }
+
+      pending |= __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != tail;
+      link = &ring->next;
+   }
+   pthread_mutex_unlock(&log_rings_mutex);
+   fflush(stderr);
+   return pending;
+}
+
+static void *log_thread_main(__attribute_maybe_unused__ void *data)
+{
+   // only runs when no one else needs the CPU, the rings buffer the messages meanwhile
+   struct sched_param parameters = { .sched_priority = 0 };
+   pthread_setschedparam(pthread_self(), SCHED_IDLE, &parameters);
+
+   while (!log_quitting)
+   {
+      __atomic_store_n(&log_sleeping, 1, __ATOMIC_SEQ_CST);
+      if (!drain_log_rings())
+      {
+         struct pollfd pollfd = { .fd = log_eventfd, .events = POLLIN };
+         poll(&pollfd, 1, -1);
+      }
+      __atomic_store_n(&log_sleeping, 0, __ATOMIC_SEQ_CST);
+
+      uint64_t count;
+      ssize_t ret = read(log_eventfd, &count, sizeof(count));
+      (void)ret;
+   }
+
+   drain_log_rings();
+   return NULL;
+}
+
+static void start_log_thread()
+{
+   log_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (log_eventfd < 0)
+      return;  // stays synchronous
+
+   pthread_key_create(&log_ring_key, abandon_log_ring);
+   log_thread_running = create_thread(&log_thread, log_thread_main, NULL) == 0;
+}
+
+static void stop_log_thread()
+{
+   if (!log_thread_running)
+      return;
+
+   log_quitting = true;
+   uint64_t one = 1;
+   ssize_t ret = write(log_eventfd, &one, sizeof(one));
+   (void)ret;
+   pthread_join(log_thread, NULL);
+   log_thread_running = false;
+   close(log_eventfd);
+}
+
+// opens and creates one uinput device for the codes of config, returns its file descriptor or -1
+static int uinput_open(int i, const struct TranslationConfig *config, const char *personality_name, bool has_force_feedback)
+{
+   int fd = open(uinput_path, O_RDWR | O_NONBLOCK);
+   if (fd < 0)
+   {
+      log_message("error opening %s: %s\n", uinput_path, strerror(errno));
+      return -1;
+   }
 
    // buttons
-   ioctl(port->uinput, UI_SET_EVBIT, EV_KEY);
-   int length = sizeof(button_code_values) / sizeof(button_code_values[0]);
-   for (int j=0; j < length; j++)
+   ioctl(fd, UI_SET_EVBIT, EV_KEY);
+   for (int j=0; j < BUTTON_COUNT; j++)
    {
-      int button_code = button_code_values[j];
+      int button_code = config->button_codes[j];
       if (button_code != -1)
-         ioctl(port->uinput, UI_SET_KEYBIT, button_code);
+         ioctl(fd, UI_SET_KEYBIT, button_code);
    }
 
-   if (uses_trigger_left == trigger_binary)
-      ioctl(port->uinput, UI_SET_KEYBIT, trigger_buttons[0]);
-   if (uses_trigger_right == trigger_binary)
-      ioctl(port->uinput, UI_SET_KEYBIT, trigger_buttons[1]);
-   if (uses_thumbstick_left == thumbstick_dpad || uses_thumbstick_left == thumbstick_dpad_sensitive || uses_thumbstick_right == thumbstick_dpad || uses_thumbstick_right == thumbstick_dpad_sensitive)
+   if (config->trigger_left == trigger_binary)
+      ioctl(fd, UI_SET_KEYBIT, trigger_buttons[0]);
+   if (config->trigger_right == trigger_binary)
+      ioctl(fd, UI_SET_KEYBIT, trigger_buttons[1]);
+   if (config->thumbstick_left == thumbstick_dpad || config->thumbstick_left == thumbstick_dpad_sensitive || config->thumbstick_right == thumbstick_dpad || config->thumbstick_right == thumbstick_dpad_sensitive)
    {
       int length = sizeof(dpad_button_codes) / sizeof(dpad_button_codes[0]);
       for (int j=0; j < length; j++)
       {
-         ioctl(port->uinput, UI_SET_KEYBIT, dpad_button_codes[j]);
+         ioctl(fd, UI_SET_KEYBIT, dpad_button_codes[j]);
       }
    }
 
    // axis
-   ioctl(port->uinput, UI_SET_EVBIT, EV_ABS);  // do we need to toggle this off when no axes are used?
+   ioctl(fd, UI_SET_EVBIT, EV_ABS);  // do we need to toggle this off when no axes are used?
    for (int i=0; i < AXIS_COUNT; i++)
    {
-      int code = axis_code_values[i].lo;
+      int code = config->axis_codes[i].lo;
       if (code >= 0)
-         ioctl(port->uinput, UI_SET_ABSBIT, code);
+         ioctl(fd, UI_SET_ABSBIT, code);
 
-      code = axis_code_values[i].hi;
+      code = config->axis_codes[i].hi;
       if (code >= 0)
-         ioctl(port->uinput, UI_SET_ABSBIT, code);
+         ioctl(fd, UI_SET_ABSBIT, code);
+   }
+
+   if (uses_msc_timestamp)
+   {
+      ioctl(fd, UI_SET_EVBIT, EV_MSC);
+      ioctl(fd, UI_SET_MSCBIT, MSC_TIMESTAMP);
    }
 
    // rumble
-   ioctl(port->uinput, UI_SET_EVBIT, EV_FF);
-   ioctl(port->uinput, UI_SET_FFBIT, FF_PERIODIC);
-   ioctl(port->uinput, UI_SET_FFBIT, FF_SQUARE);
-   ioctl(port->uinput, UI_SET_FFBIT, FF_TRIANGLE);
-   ioctl(port->uinput, UI_SET_FFBIT, FF_SINE);
-   ioctl(port->uinput, UI_SET_FFBIT, FF_RUMBLE);
-   uinput_dev.ff_effects_max = MAX_FF_EVENTS;
-
-   snprintf(uinput_dev.name, sizeof(uinput_dev.name), device_name, i+1);
-   uinput_dev.name[sizeof(uinput_dev.name)-1] = 0;
-   uinput_dev.id.bustype = BUS_USB;
-   uinput_dev.id.vendor = vendor_id;
-   uinput_dev.id.product = product_id;
-
-   size_t to_write = sizeof(uinput_dev);
+   if (has_force_feedback)
+   {
+      ioctl(fd, UI_SET_EVBIT, EV_FF);
+      ioctl(fd, UI_SET_FFBIT, FF_PERIODIC);
+      ioctl(fd, UI_SET_FFBIT, FF_SQUARE);
+      ioctl(fd, UI_SET_FFBIT, FF_TRIANGLE);
+      ioctl(fd, UI_SET_FFBIT, FF_SINE);
+      ioctl(fd, UI_SET_FFBIT, FF_RUMBLE);
+   }
+
+   // the device settings are shared by all adapter threads and stay read-only after startup
+   struct uinput_user_dev device_settings = *config->device_settings;
+   device_settings.ff_effects_max = has_force_feedback ? MAX_FF_EVENTS : 0;
+
+   int name_length = snprintf(device_settings.name, sizeof(device_settings.name), device_name, i+1);
+   if (personality_name != NULL && name_length >= 0 && (size_t)name_length < sizeof(device_settings.name))
+      snprintf(device_settings.name + name_length, sizeof(device_settings.name) - name_length, " (%s)", personality_name);
+   device_settings.name[sizeof(device_settings.name)-1] = 0;
+   device_settings.id.bustype = BUS_USB;
+   device_settings.id.vendor = vendor_id;
+   device_settings.id.product = product_id;
+
+   size_t to_write = sizeof(device_settings);
    size_t written = 0;
    while (written < to_write)
    {
-      ssize_t write_ret = write(port->uinput, (const char*)&uinput_dev + written, to_write - written);
+      ssize_t write_ret = write(fd, (const char*)&device_settings + written, to_write - written);
       if (write_ret < 0)
       {
-         perror("error writing uinput device settings");
-         close(port->uinput);
-         return false;
+         log_message("error writing uinput device settings: %s\n", strerror(errno));
+         close(fd);
+         return -1;
       }
       written += write_ret;
    }
 
-   if (ioctl(port->uinput, UI_DEV_CREATE) != 0)
+   if (ioctl(fd, UI_DEV_CREATE) != 0)
    {
-      perror("error creating uinput device");
-      close(port->uinput);
-      return false;
+      log_message("error creating uinput device: %s\n", strerror(errno));
+      close(fd);
+      return -1;
    }
+   return fd;
+}
+
+static bool uinput_create(int i, struct ports *port, unsigned char type)
+{
+   log_message("connecting on port %d\n", i);
+   port->uinput = uinput_open(i, &translation, NULL, true);
+   if (port->uinput < 0)
+      return false;
+
+   // a personality which fails is left out, the port works without it
+   for (int p = 0; p < personality_count; p++)
+      port->personality_outputs[p].uinput = uinput_open(i, &personalities[p].config, personalities[p].name, false);
+
    port->type = type;
    port->connected = true;
    return true;
@@ -752,7 +1353,17 @@ static bool uinput_create(int i, struct ports *port, unsigned char type)
 
 static void uinput_destroy(int i, struct ports *port)
 {
-   fprintf(stderr, "disconnecting on port %d\n", i);
+   log_message("disconnecting on port %d\n", i);
+   for (int p = 0; p < personality_count; p++)
+   {
+      struct PersonalityOutput *output = &port->personality_outputs[p];
+      if (output->uinput >= 0)
+      {
+         ioctl(output->uinput, UI_DEV_DESTROY);
+         close(output->uinput);
+         output->uinput = -1;
+      }
+   }
    ioctl(port->uinput, UI_DEV_DESTROY);
    close(port->uinput);
    port->connected = false;
@@ -810,63 +1421,266 @@ static void update_ff_start_stop(struct ff_event *e, struct timespec *current_ti
    }
 }
 
-static int create_ff_event(struct ports *port, struct uinput_ff_upload *upload)
+// generic gamepad: 12 buttons, 4 bits padding, X, Y, Rx, Ry, Z, Rz with 8 bits each and one vendor defined output byte for rumble
+static const unsigned char uhid_report_descriptor[] = {
+   0x05, 0x01,        // Usage Page (Generic Desktop)
+   0x09, 0x05,        // Usage (Game Pad)
+   0xa1, 0x01,        // Collection (Application)
+   0x05, 0x09,        //   Usage Page (Button)
+   0x19, 0x01,        //   Usage Minimum (1)
+   0x29, 0x0c,        //   Usage Maximum (12)
+   0x15, 0x00,        //   Logical Minimum (0)
+   0x25, 0x01,        //   Logical Maximum (1)
+   0x75, 0x01,        //   Report Size (1)
+   0x95, 0x0c,        //   Report Count (12)
+   0x81, 0x02,        //   Input (Data, Variable, Absolute)
+   0x95, 0x04,        //   Report Count (4)
+   0x81, 0x03,        //   Input (Constant)
+   0x05, 0x01,        //   Usage Page (Generic Desktop)
+   0x09, 0x30,        //   Usage (X)
+   0x09, 0x31,        //   Usage (Y)
+   0x09, 0x33,        //   Usage (Rx)
+   0x09, 0x34,        //   Usage (Ry)
+   0x09, 0x32,        //   Usage (Z)
+   0x09, 0x35,        //   Usage (Rz)
+   0x15, 0x00,        //   Logical Minimum (0)
+   0x26, 0xff, 0x00,  //   Logical Maximum (255)
+   0x75, 0x08,        //   Report Size (8)
+   0x95, 0x06,        //   Report Count (6)
+   0x81, 0x02,        //   Input (Data, Variable, Absolute)
+   0x06, 0x00, 0xff,  //   Usage Page (Vendor Defined)
+   0x09, 0x01,        //   Usage (1)
+   0x95, 0x01,        //   Report Count (1)
+   0x91, 0x02,        //   Output (Data, Variable, Absolute), rumble on when not 0
+   0xc0,              // End Collection
+};
+
+// HID button n+1 is the GCN button with this index
+static const int uhid_button_indices[12] = {
+   a_button_index, b_button_index, x_button_index, y_button_index,
+   l_button_index, r_button_index, z_button_index, start_button_index,
+   up_button_index, down_button_index, left_button_index, right_button_index,
+};
+
+static bool uhid_write(int fd, struct uhid_event *event)
 {
-   bool stop = false;
-   switch (upload->effect.type)
+   ssize_t ret = write(fd, event, sizeof(*event));
+   if (ret != sizeof(*event))
    {
-      case FF_PERIODIC:
-         stop = upload->effect.u.periodic.magnitude == 0;
-         break;
-      case FF_RUMBLE:
-         stop = upload->effect.u.rumble.strong_magnitude == 0 && upload->effect.u.rumble.weak_magnitude == 0;
-         break;
+      log_ratelimited("error writing uhid event: %s\n", strerror(errno));
+      return false;
    }
-   if (upload->old.type != 0)
+   return true;
+}
+
+static bool uhid_create(int i, struct ports *port, unsigned char type)
+{
+   log_message("connecting on port %d\n", i);
+   port->uhid = open(uhid_path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+   if (port->uhid < 0)
    {
-      if (stop)
-      {
-         port->ff_events[upload->old.id].forever = false;
-         port->ff_events[upload->old.id].duration = 0;
-      }
-      else
-      {
-         // events with length 0 last forever
-         port->ff_events[upload->old.id].forever = (upload->effect.replay.length == 0);
-         port->ff_events[upload->old.id].duration = upload->effect.replay.length;
-      }
-      port->ff_events[upload->old.id].delay = upload->effect.replay.delay;
-      port->ff_events[upload->old.id].repetitions = 0;
-      return upload->old.id;
+      log_message("error opening %s: %s\n", uhid_path, strerror(errno));
+      return false;
    }
-   for (int i = 0; i < MAX_FF_EVENTS; i++)
+
+   struct uhid_event event;
+   memset(&event, 0, sizeof(event));
+   event.type = UHID_CREATE2;
+   snprintf((char*)event.u.create2.name, sizeof(event.u.create2.name), device_name, i+1);
+   snprintf((char*)event.u.create2.phys, sizeof(event.u.create2.phys), "wii-u-gc-adapter/%d/%d", port->adapter_id, i+1);
+   event.u.create2.rd_size = sizeof(uhid_report_descriptor);
+   memcpy(event.u.create2.rd_data, uhid_report_descriptor, sizeof(uhid_report_descriptor));
+   event.u.create2.bus = BUS_USB;
+   event.u.create2.vendor = vendor_id;
+   event.u.create2.product = product_id;
+
+   if (!uhid_write(port->uhid, &event))
    {
-      if (!port->ff_events[i].in_use)
-      {
-         port->ff_events[i].in_use = true;
-         if (stop)
-         {
-            port->ff_events[i].forever = false;
-            port->ff_events[i].duration = 0;
-         }
-         else
-         {
-            port->ff_events[i].forever = (upload->effect.replay.length == 0);
-            port->ff_events[i].duration = upload->effect.replay.length;
-         }
-         port->ff_events[i].delay = upload->effect.replay.delay;
-         port->ff_events[i].repetitions = 0;
-         return i;
-      }
+      close(port->uhid);
+      return false;
    }
 
-   return -1;
+   memset(port->uhid_report, 0, sizeof(port->uhid_report));
+   port->uhid_report_sent = false;
+   port->type = type;
+   port->connected = true;
+   return true;
 }
 
-static void add_button_event(struct input_event events[], int *events_count, uint16_t previous_button_state, uint16_t *result_button_state, const int button_codes[], uint16_t button_pressed_mask, int tested_button_id)
+static void uhid_destroy(int i, struct ports *port)
 {
-   int button_code = button_codes[tested_button_id];
-   if (button_code == -1)
+   log_message("disconnecting on port %d\n", i);
+   struct uhid_event event;
+   memset(&event, 0, sizeof(event));
+   event.type = UHID_DESTROY;
+   uhid_write(port->uhid, &event);
+   close(port->uhid);
+   port->connected = false;
+}
+
+// a rumble output report is treated like an endless force feedback effect in slot 0
+static void uhid_set_rumble(struct ports *port, bool rumbling, struct timespec *current_time)
+{
+   struct ff_event *e = &port->ff_events[0];
+   e->in_use = true;
+   e->forever = true;
+   e->delay = 0;
+   e->duration = 0;
+   e->repetitions = rumbling ? 1 : 0;
+   update_ff_start_stop(e, current_time);
+}
+
+// one fixed size input report per changed packet, then the pending output requests of the HID device
+static void uhid_handle_payload(struct ports *port, unsigned char *payload, struct timespec *current_time)
+{
+   uint16_t btns = (uint16_t) payload[1] << 8 | (uint16_t) payload[2];
+   unsigned char report[8] = { 0 };
+   for (int j = 0; j < 12; j++)
+   {
+      if (btns & (1 << uhid_button_indices[j]))
+         report[j / 8] |= 1 << (j % 8);
+   }
+   for (int j = 0; j < AXIS_COUNT; j++)
+   {
+      unsigned char value = payload[3 + j];
+      if (flips_y_axis && (j == thumbl_y_index || j == thumbr_y_index))
+         value ^= 0xff;
+      report[2 + j] = value;
+   }
+   port->translated.buttons = btns;
+
+   if (!port->uhid_report_sent || memcmp(report, port->uhid_report, sizeof(report)) != 0)
+   {
+      struct uhid_event event;
+      event.type = UHID_INPUT2;
+      event.u.input2.size = sizeof(report);
+      memcpy(event.u.input2.data, report, sizeof(report));
+      // only the used part of the event is written
+      size_t to_write = offsetof(struct uhid_event, u.input2.data) + sizeof(report);
+      count_metric(port->metrics.events_written, 1);
+      count_metric(port->metrics.writes, 1);
+      if (write(port->uhid, &event, to_write) != (ssize_t)to_write)
+         log_ratelimited("Warning: writing uhid input report failed: %s\n", strerror(errno));
+      memcpy(port->uhid_report, report, sizeof(report));
+      port->uhid_report_sent = true;
+   }
+
+   struct uhid_event event;
+   ssize_t ret = read(port->uhid, &event, sizeof(event));
+   if (ret <= 0)
+      return;
+
+   switch (event.type)
+   {
+      case UHID_OUTPUT:
+         count_metric(port->metrics.ff_plays, 1);
+         TRACE_PROBE(ff_play, port->adapter_id, port->port_index, 0, event.u.output.size > 0 ? event.u.output.data[0] : 0);
+         if (event.u.output.size > 0)
+            uhid_set_rumble(port, event.u.output.data[0] != 0, current_time);
+         break;
+      case UHID_GET_REPORT:
+      {
+         uint32_t id = event.u.get_report.id;
+         memset(&event, 0, sizeof(event));
+         event.type = UHID_GET_REPORT_REPLY;
+         event.u.get_report_reply.id = id;
+         event.u.get_report_reply.err = EIO;
+         uhid_write(port->uhid, &event);
+         break;
+      }
+      case UHID_SET_REPORT:
+      {
+         uint32_t id = event.u.set_report.id;
+         memset(&event, 0, sizeof(event));
+         event.type = UHID_SET_REPORT_REPLY;
+         event.u.set_report_reply.id = id;
+         event.u.set_report_reply.err = EIO;
+         uhid_write(port->uhid, &event);
+         break;
+      }
+   }
+}
+
+static bool output_create(int i, struct ports *port, unsigned char type)
+{
+   if (output_backend == output_backend_uhid)
+      return uhid_create(i, port, type);
+   if (output_backend == output_backend_null || output_backend == output_backend_none)
+   {
+      port->type = type;
+      port->connected = true;
+      return true;
+   }
+   return uinput_create(i, port, type);
+}
+
+static void output_destroy(int i, struct ports *port)
+{
+   if (output_backend == output_backend_uhid)
+      uhid_destroy(i, port);
+   else if (output_backend == output_backend_null || output_backend == output_backend_none)
+      port->connected = false;
+   else
+      uinput_destroy(i, port);
+}
+
+static int create_ff_event(struct ports *port, struct uinput_ff_upload *upload)
+{
+   bool stop = false;
+   switch (upload->effect.type)
+   {
+      case FF_PERIODIC:
+         stop = upload->effect.u.periodic.magnitude == 0;
+         break;
+      case FF_RUMBLE:
+         stop = upload->effect.u.rumble.strong_magnitude == 0 && upload->effect.u.rumble.weak_magnitude == 0;
+         break;
+   }
+   if (upload->old.type != 0)
+   {
+      if (stop)
+      {
+         port->ff_events[upload->old.id].forever = false;
+         port->ff_events[upload->old.id].duration = 0;
+      }
+      else
+      {
+         // events with length 0 last forever
+         port->ff_events[upload->old.id].forever = (upload->effect.replay.length == 0);
+         port->ff_events[upload->old.id].duration = upload->effect.replay.length;
+      }
+      port->ff_events[upload->old.id].delay = upload->effect.replay.delay;
+      port->ff_events[upload->old.id].repetitions = 0;
+      return upload->old.id;
+   }
+   for (int i = 0; i < MAX_FF_EVENTS; i++)
+   {
+      if (!port->ff_events[i].in_use)
+      {
+         port->ff_events[i].in_use = true;
+         if (stop)
+         {
+            port->ff_events[i].forever = false;
+            port->ff_events[i].duration = 0;
+         }
+         else
+         {
+            port->ff_events[i].forever = (upload->effect.replay.length == 0);
+            port->ff_events[i].duration = upload->effect.replay.length;
+         }
+         port->ff_events[i].delay = upload->effect.replay.delay;
+         port->ff_events[i].repetitions = 0;
+         return i;
+      }
+   }
+
+   return -1;
+}
+
+static inline __attribute__((always_inline)) void add_button_event(const struct TranslationConfig *config, struct input_event events[], int *events_count, uint16_t previous_button_state, uint16_t *result_button_state, const int button_codes[], uint16_t button_pressed_mask, int tested_button_id)
+{
+   int button_code = button_codes[tested_button_id];
+   if (button_code == -1)
       return;
 
    uint16_t single_button_mask = (1 << tested_button_id);
@@ -875,7 +1689,7 @@ static void add_button_event(struct input_event events[], int *events_count, uin
 
    if ((previous_button_state & single_button_mask) != single_button_pressed_mask)
    {
-      bool ignores_button = (uses_trigger_left == trigger_binary && button_code == trigger_buttons[0]) || (uses_trigger_right == trigger_binary && button_code == trigger_buttons[1]);
+      bool ignores_button = (config->trigger_left == trigger_binary && button_code == trigger_buttons[0]) || (config->trigger_right == trigger_binary && button_code == trigger_buttons[1]);
       if (!ignores_button)
       {
          int e_count = *events_count;
@@ -911,17 +1725,14 @@ static bool is_dpad_pressed(int axis_value, int perpendicular_value, int min_axi
 }
 
 #define DPAD_FILTER_LENGTH 4  // 2 * filter length -1 = number of available duty cycles
-static struct DeltaModulator {
-   unsigned char unit_duration;  // time duration of a unit of equal return values
-   signed char duty_cycle_units; // keydown to keyup ratio = 1:-n or +n:1, 1 complement, negative values represent duty cycles of keyup
-   unsigned char time;
-} thumbstick_filter[AXIS_COUNT] = {
-   { .unit_duration = 4, .duty_cycle_units = 0, .time = 0, },
-   { .unit_duration = 4, .duty_cycle_units = 0, .time = 0, },
-   { .unit_duration = 4, .duty_cycle_units = 0, .time = 0, },
-   { .unit_duration = 4, .duty_cycle_units = 0, .time = 0, },
-};
-int step_levels[] = {
+
+static void reset_thumbstick_filters(struct TranslationState *state)
+{
+   for (int j = 0; j < AXIS_COUNT; j++)
+      state->thumbstick_filter[j] = (struct DeltaModulator){ .unit_duration = 4, .duty_cycle_units = 0, .time = 0, };
+}
+
+static int step_levels[] = {
    15 * 15, // 0
    37 * 37, // 1/4
    50 * 50, // 1/3
@@ -978,7 +1789,7 @@ static bool read_thumbstick_filter(struct DeltaModulator *filter)
 
    filter->time++;
 
-   //if (filter == &thumbstick_filter[2])
+   //if (filter == &port->thumbstick_filter[2])
    //{
    //   putc(bit_value ? '*' : ' ', stderr);
    //}
@@ -1011,9 +1822,9 @@ static int signed_to_axis_value(int signed_value, int axis_index, enum AxisDivis
    return axis_value >= 0 ? axis_value + start_value : start_value;
 }
 
-static bool approx_deltamodulation(struct DeltaModulator *filter, int axis_value, int current_axis)
+static bool approx_deltamodulation(const struct TranslationConfig *config, struct DeltaModulator *filter, int axis_value, int current_axis)
 {
-   int max_length = axis_value_to_signed(uinput_dev.absmax[current_axis]);
+   int max_length = axis_value_to_signed(config->device_settings->absmax[current_axis]);
    int max_length_squared = max_length * max_length;
    int tilt_length_squared = axis_value * axis_value;
    int percent_squared = tilt_length_squared * 10000 / max_length_squared;
@@ -1023,8 +1834,9 @@ static bool approx_deltamodulation(struct DeltaModulator *filter, int axis_value
    return read_thumbstick_filter(filter);
 }
 
-static void map_thumbstick_to_dpad(struct input_event events[], int *events_count, struct ports *port, int current_axis, unsigned char payload[], int axis_index, enum ThumbstickMode thumbstick_mode)
+static void map_thumbstick_to_dpad(const struct TranslationConfig *config, struct input_event events[], int *events_count, __attribute_maybe_unused__ struct ports *port, struct TranslationState *state, int current_axis, unsigned char payload[], int axis_index, enum ThumbstickMode thumbstick_mode)
 {
+   PROFILE_BEGIN(dpad);
    //righthand 2D coordinates
    signed char axis_value = axis_value_to_signed(payload[axis_index]);
    signed char perpendicular_axis_value = axis_value_to_signed(payload[axis_index ^ 1]);
@@ -1032,9 +1844,9 @@ static void map_thumbstick_to_dpad(struct input_event events[], int *events_coun
 
    if (thumbstick_mode == thumbstick_dpad_sensitive)
    {
-      struct DeltaModulator *filter = &thumbstick_filter[axis_index];
+      struct DeltaModulator *filter = &state->thumbstick_filter[axis_index];
       if (uses_axis)
-         uses_axis = approx_deltamodulation(filter, axis_value, current_axis);
+         uses_axis = approx_deltamodulation(config, filter, axis_value, current_axis);
       else
          filter->time = 0;
    }
@@ -1047,7 +1859,7 @@ static void map_thumbstick_to_dpad(struct input_event events[], int *events_coun
    int value = (is_positive_axis << 1) | 1;
    int opposite_value = value ^ 2;
    // turn off opposite direction
-   if (port->axis[axis_index] == opposite_value)
+   if (state->axis[axis_index] == opposite_value)
    {
       events[e_count].type = EV_KEY;
       events[e_count].code = dpad_button_codes[button_index ^ 1];
@@ -1055,7 +1867,7 @@ static void map_thumbstick_to_dpad(struct input_event events[], int *events_coun
       e_count++;
    }
 
-   if (uses_axis != (port->axis[axis_index] == value))
+   if (uses_axis != (state->axis[axis_index] == value))
    {
       events[e_count].type = EV_KEY;
       events[e_count].code = dpad_button_codes[button_index];
@@ -1063,16 +1875,17 @@ static void map_thumbstick_to_dpad(struct input_event events[], int *events_coun
       e_count++;
    }
 
-   port->axis[axis_index] = value & (-2 | (int)uses_axis);
+   state->axis[axis_index] = value & (-2 | (int)uses_axis);
    *events_count = e_count;
+   PROFILE_END(port->profile, stage_dpad, dpad);
 }
 
-static void add_axis_value(struct input_event events[], int *events_count, int axis_code, int new_value, uint8_t *old_value)
+static inline __attribute__((always_inline)) void add_axis_value(const struct TranslationConfig *config, struct input_event events[], int *events_count, int axis_code, int new_value, uint8_t *old_value)
 {
    struct input_event *event = &events[*events_count];
 
-   int min = uinput_dev.absmin[axis_code];
-   int max = uinput_dev.absmax[axis_code];
+   int min = config->device_settings->absmin[axis_code];
+   int max = config->device_settings->absmax[axis_code];
    if (new_value < min)
       new_value = min;
    else if (new_value > max)
@@ -1086,7 +1899,7 @@ static void add_axis_value(struct input_event events[], int *events_count, int a
    event->code = axis_code;
    *old_value = new_value;
 
-   struct AxisScale *axis_scale = axis_scales[axis_code];
+   struct AxisScale *axis_scale = config->scales_axes ? axis_scales[axis_code] : NULL;
    if (axis_scale == NULL)
    {
       event->value = new_value;
@@ -1101,18 +1914,18 @@ static void add_axis_value(struct input_event events[], int *events_count, int a
    event->value = start_value + offset;
 }
 
-static void add_axis_event(struct input_event events[], int *events_count, unsigned char payload[], struct ports *port, int axis_index, int current_axis, enum AxisDivision axis_division)
+static inline __attribute__((always_inline)) void add_axis_event(const struct TranslationConfig *config, struct input_event events[], int *events_count, unsigned char payload[], struct ports *port, struct TranslationState *state, int axis_index, int current_axis, enum AxisDivision axis_division)
 {
    if (current_axis < 0) return;
 
    unsigned char value = payload[axis_index];
 
-   bool is_left_shoulder_pressed_down = port->buttons & (1 << l_button_index);
-   bool is_right_shoulder_pressed_down = port->buttons & (1 << r_button_index);
+   bool is_left_shoulder_pressed_down = state->buttons & (1 << l_button_index);
+   bool is_right_shoulder_pressed_down = state->buttons & (1 << r_button_index);
 
    if (axis_index == thumbl_y_index || axis_index == thumbr_y_index)
    {
-      if (flips_y_axis)
+      if (config->flips_y_axis)
       {
          if (axis_division == full_axis)
             value ^= 0xFF;
@@ -1124,10 +1937,10 @@ static void add_axis_event(struct input_event events[], int *events_count, unsig
 
    value = signed_to_axis_value(axis_value_to_signed(value), axis_index, axis_division);
 
-   if ((axis_index == trigger_l_index && uses_trigger_left == trigger_binary) || (axis_index == trigger_r_index && uses_trigger_right == trigger_binary))
+   if ((axis_index == trigger_l_index && config->trigger_left == trigger_binary) || (axis_index == trigger_r_index && config->trigger_right == trigger_binary))
    {
-      value = value > uinput_dev.absmin[current_axis] + 10;
-      if (uses_shoulder_button == shoulder_button_nand)
+      value = value > config->device_settings->absmin[current_axis] + 10;
+      if (config->shoulder_button == shoulder_button_nand)
       {
          if (axis_index == trigger_l_index)
             value = value & !is_left_shoulder_pressed_down;
@@ -1135,7 +1948,7 @@ static void add_axis_event(struct input_event events[], int *events_count, unsig
             value = value & !is_right_shoulder_pressed_down;
       }
 
-      if (port->axis[axis_index] != value)
+      if (state->axis[axis_index] != value)
       {
          int e_count = *events_count;
          events[e_count].type = EV_KEY;
@@ -1143,325 +1956,3612 @@ static void add_axis_event(struct input_event events[], int *events_count, unsig
          events[e_count].value = value;
          e_count++;
          *events_count = e_count;
-         port->axis[axis_index] = value;
+         state->axis[axis_index] = value;
       }
       return;
    }
-   else if (uses_shoulder_button == shoulder_button_nand)
+   else if (config->shoulder_button == shoulder_button_nand)
    {
       if (is_left_shoulder_pressed_down && axis_index == trigger_l_index)
-         value = uinput_dev.absmin[current_axis];
+         value = config->device_settings->absmin[current_axis];
       else if (is_right_shoulder_pressed_down && axis_index == trigger_r_index)
-         value = uinput_dev.absmin[current_axis];
+         value = config->device_settings->absmin[current_axis];
    }
 
-   if (uses_thumbstick_left != thumbstick_normal && (axis_index == thumbl_x_index || axis_index == thumbl_y_index))
+   if (config->thumbstick_left != thumbstick_normal && (axis_index == thumbl_x_index || axis_index == thumbl_y_index))
    {
-      map_thumbstick_to_dpad(events, events_count, port, current_axis, payload, axis_index, uses_thumbstick_left);
+      map_thumbstick_to_dpad(config, events, events_count, port, state, current_axis, payload, axis_index, config->thumbstick_left);
       return;
    }
-   if (uses_thumbstick_right != thumbstick_normal && (axis_index == thumbr_x_index || axis_index == thumbr_y_index))
+   if (config->thumbstick_right != thumbstick_normal && (axis_index == thumbr_x_index || axis_index == thumbr_y_index))
    {
-      map_thumbstick_to_dpad(events, events_count, port, current_axis, payload, axis_index, uses_thumbstick_right);
+      map_thumbstick_to_dpad(config, events, events_count, port, state, current_axis, payload, axis_index, config->thumbstick_right);
       return;
    }
 
-   add_axis_value(events, events_count, current_axis, value, &port->axis[axis_index]);
+   add_axis_value(config, events, events_count, current_axis, value, &state->axis[axis_index]);
 }
 
-static void handle_payload(int i, struct ports *port, unsigned char *payload, struct timespec *current_time)
+/** Appends the input events for the changes of one report to events[] and returns their number, without the SYN event.
+ *  Always inlined with a constant config, so the compiler drops the checks of the modes which are off.
+ */
+static inline __attribute__((always_inline)) int translate_report_with(const struct TranslationConfig *config, struct input_event events[], struct ports *port, struct TranslationState *state, unsigned char *payload)
 {
-   unsigned char status = payload[0];
-   unsigned char type = connected_type(status);
+   int e_count = 0;
 
-   if (type != 0 && !port->connected)
+   uint16_t btns = (uint16_t) payload[1] << 8 | (uint16_t) payload[2];
+
+   uint16_t previous_buttons_state = state->buttons;
+
+   PROFILE_BEGIN(buttons);
+   for (int j = 0; j < BUTTON_COUNT; j++)
+      add_button_event(config, events, &e_count, previous_buttons_state, &state->buttons, config->button_codes, btns, j);
+   PROFILE_END(port->profile, stage_buttons, buttons);
+
+   PROFILE_BEGIN_OUTER(port->profile, axes, stage_dpad);
+   for (int j = 0; j < AXIS_COUNT; j++)
    {
-      uinput_create(i, port, type);
+      int lower_axis = config->axis_codes[j].lo;
+      add_axis_event(config, events, &e_count, payload+3, port, state, j, config->axis_codes[j].hi, lower_axis < 0? full_axis : upper_half_axis);
+      add_axis_event(config, events, &e_count, payload+3, port, state, j, lower_axis, lower_half_axis);
    }
-   else if (type == 0 && port->connected)
-   {
-      uinput_destroy(i, port);
+   PROFILE_END_OUTER(port->profile, stage_axes, axes, stage_dpad);
+
+   return e_count;
+}
+
+typedef int (*ReportTranslator)(struct input_event events[], struct ports *port, struct TranslationState *state, unsigned char *payload);
+
+// reads the modes from the config on every report, works for every combination of options
+static int translate_report_configured(const struct TranslationConfig *config, struct input_event events[], struct ports *port, struct TranslationState *state, unsigned char *payload)
+{
+   return translate_report_with(config, events, port, state, payload);
+}
+
+static int translate_report_generic(struct input_event events[], struct ports *port, struct TranslationState *state, unsigned char *payload)
+{
+   return translate_report_configured(&translation, events, port, state, payload);
+}
+
+// the mapping is always the one of the command line options
+#define DEFINE_REPORT_TRANSLATOR(name, ...) \
+   static const struct TranslationConfig name##_config = { \
+      .button_codes = button_code_values, .axis_codes = axis_code_values, .device_settings = &uinput_dev, __VA_ARGS__ }; \
+   static int name(struct input_event events[], struct ports *port, struct TranslationState *state, unsigned char *payload) \
+   { \
+      return translate_report_with(&name##_config, events, port, state, payload); \
    }
 
-   if (!port->connected)
-      return;
+// the combinations of the default and the most common mapping options, without axis scales
+DEFINE_REPORT_TRANSLATOR(translate_report_default,
+   .shoulder_button = shoulder_button_none, .thumbstick_left = thumbstick_normal, .thumbstick_right = thumbstick_normal,
+   .trigger_left = trigger_normal, .trigger_right = trigger_normal, .flips_y_axis = true, .scales_axes = false)
+DEFINE_REPORT_TRANSLATOR(translate_report_unflipped,
+   .shoulder_button = shoulder_button_none, .thumbstick_left = thumbstick_normal, .thumbstick_right = thumbstick_normal,
+   .trigger_left = trigger_normal, .trigger_right = trigger_normal, .flips_y_axis = false, .scales_axes = false)
+DEFINE_REPORT_TRANSLATOR(translate_report_shoulder,
+   .shoulder_button = shoulder_button_and, .thumbstick_left = thumbstick_normal, .thumbstick_right = thumbstick_normal,
+   .trigger_left = trigger_normal, .trigger_right = trigger_normal, .flips_y_axis = true, .scales_axes = false)
+DEFINE_REPORT_TRANSLATOR(translate_report_binary_triggers,
+   .shoulder_button = shoulder_button_none, .thumbstick_left = thumbstick_normal, .thumbstick_right = thumbstick_normal,
+   .trigger_left = trigger_binary, .trigger_right = trigger_binary, .flips_y_axis = true, .scales_axes = false)
+
+static const struct {
+   const struct TranslationConfig *config;
+   ReportTranslator translate;
+} specialized_translators[] = {
+   { &translate_report_default_config, translate_report_default },
+   { &translate_report_unflipped_config, translate_report_unflipped },
+   { &translate_report_shoulder_config, translate_report_shoulder },
+   { &translate_report_binary_triggers_config, translate_report_binary_triggers },
+};
 
-   port->extra_power = ((status & 0x04) != 0);
+/** The -r fast path: the button bits and the six axis bytes exactly as reported, with fixed codes.
+ *  Only changes are emitted, there is no flip, rescaling or mode handling per sample.
+ */
+static int translate_report_raw(struct input_event events[], __attribute_maybe_unused__ struct ports *port, struct TranslationState *state, unsigned char *payload)
+{
+   int e_count = 0;
 
-   if (type != port->type)
+   uint16_t btns = ((uint16_t) payload[1] << 8 | (uint16_t) payload[2]) & RAW_BUTTON_MASK;
+   uint16_t changed_buttons = btns ^ state->buttons;
+   state->buttons = btns;
+   PROFILE_BEGIN(buttons);
+   while (changed_buttons != 0)
    {
-      fprintf(stderr, "controller on port %d changed controller type???\n", i+1);
-      port->type = type;
+      int j = __builtin_ctz(changed_buttons);
+      changed_buttons &= changed_buttons - 1;
+      events[e_count].type = EV_KEY;
+      events[e_count].code = RAW_BUTTON_VALUES[j];
+      events[e_count].value = (btns >> j) & 1;
+      e_count++;
    }
+   PROFILE_END(port->profile, stage_buttons, buttons);
 
-   struct input_event events[16+6+1] = {0}; // buttons + axis + syn event
-   int e_count = 0;
+   PROFILE_BEGIN(axes);
+   for (int j = 0; j < AXIS_COUNT; j++)
+   {
+      uint8_t value = payload[3 + j];
+      if (value == state->axis[j])
+         continue;
+      state->axis[j] = value;
+      events[e_count].type = EV_ABS;
+      events[e_count].code = RAW_AXIS_VALUES[j];
+      events[e_count].value = value;
+      e_count++;
+   }
+   PROFILE_END(port->profile, stage_axes, axes);
 
-   uint16_t btns = (uint16_t) payload[1] << 8 | (uint16_t) payload[2];
+   return e_count;
+}
 
-   uint16_t previous_buttons_state = port->buttons;
-   
-   for (int j = 0; j < BUTTON_COUNT; j++)
-      add_button_event(events, &e_count, previous_buttons_state, &port->buttons, button_code_values, btns, j);
+static ReportTranslator translate_report = translate_report_generic;
+static int max_report_events = BUTTON_COUNT + 2 * AXIS_COUNT + 1 + 1;  // events of one report including the timestamp and the SYN event
+
+static bool is_same_translation(const struct TranslationConfig *a, const struct TranslationConfig *b)
+{
+   return a->shoulder_button == b->shoulder_button && a->thumbstick_left == b->thumbstick_left && a->thumbstick_right == b->thumbstick_right
+      && a->trigger_left == b->trigger_left && a->trigger_right == b->trigger_right
+      && a->flips_y_axis == b->flips_y_axis && a->scales_axes == b->scales_axes
+      && a->button_codes == b->button_codes && a->axis_codes == b->axis_codes && a->device_settings == b->device_settings;
+}
+
+static bool is_dpad_thumbstick_axis(const struct TranslationConfig *config, int axis_index)
+{
+   if (axis_index == thumbl_x_index || axis_index == thumbl_y_index)
+      return config->thumbstick_left != thumbstick_normal;
+   if (axis_index == thumbr_x_index || axis_index == thumbr_y_index)
+      return config->thumbstick_right != thumbstick_normal;
+   return false;
+}
 
+// every mapped button and axis code can emit an event, a thumbstick axis on the D-pad emits up to two (release the opposite direction, press)
+static int count_report_events(const struct TranslationConfig *config)
+{
+   int events = 1 + 1;  // timestamp + syn event
+   for (int j = 0; j < BUTTON_COUNT; j++)
+      events += config->button_codes[j] != -1;
    for (int j = 0; j < AXIS_COUNT; j++)
    {
-      int lower_axis = axis_code_values[j].lo;
-      add_axis_event(events, &e_count, payload+3, port, j, axis_code_values[j].hi, lower_axis < 0? full_axis : upper_half_axis);
-      add_axis_event(events, &e_count, payload+3, port, j, lower_axis, lower_half_axis);
+      int events_per_code = is_dpad_thumbstick_axis(config, j) ? 2 : 1;
+      events += (config->axis_codes[j].hi >= 0) * events_per_code + (config->axis_codes[j].lo >= 0) * events_per_code;
+   }
+   return events;
+}
+
+// "--personalities xbox,literal,wheel", the devices are set up by setup_personalities()
+static void set_personalities(const char command_line_settings_[])
+{
+   char *command_line_settings = strdup(command_line_settings_);
+
+   personality_count = 0;
+   for (char *next_item = strtok(command_line_settings, ","); next_item != NULL; next_item = strtok(NULL, ","))
+   {
+      int kind = 0;
+      while (kind < personality_kinds_count && strcmp(next_item, personality_names[kind]) != 0)
+         kind++;
+      if (kind == personality_kinds_count)
+         fprintf(stderr, "argument error: unknown personality \"%s\" for --personalities\n", next_item);
+      else if (personality_count == MAX_PERSONALITIES)
+         fprintf(stderr, "argument error: at most %d personalities for --personalities\n", MAX_PERSONALITIES);
+      else
+         personality_kinds[personality_count++] = kind;
    }
 
-   if (e_count > 0)
+   free(command_line_settings);
+}
+
+// must run after process_options(), the personalities take over the absinfo options
+static void setup_personalities()
+{
+   for (int p = 0; p < personality_count; p++)
    {
-      events[e_count].type = EV_SYN;
-      events[e_count].code = SYN_REPORT;
-      e_count++;
-      size_t to_write = sizeof(events[0]) * e_count;
-      size_t written = 0;
-      while (written < to_write)
+      struct Personality *personality = &personalities[p];
+      enum PersonalityKind kind = personality_kinds[p];
+
+      personality->name = personality_names[kind];
+      memcpy(personality->button_codes, kind == personality_literal ? BUTTON_LITERAL_VALUES : BUTTON_XBOX_VALUES, sizeof(personality->button_codes));
+      for (int j = 0; j < AXIS_COUNT; j++)
+         personality->axis_codes[j] = (struct AxisCode){ -1, RAW_AXIS_VALUES[j] };  // the default axes map
+      if (kind == personality_wheel)
+      {
+         personality->axis_codes[thumbl_x_index] = (struct AxisCode){ -1, ABS_WHEEL };
+         personality->axis_codes[thumbl_y_index] = (struct AxisCode){ ABS_BRAKE, ABS_GAS };
+      }
+      personality->device_settings = uses_raw_mode ? default_udev_settings : uinput_dev;
+
+      personality->config = (struct TranslationConfig){
+         .shoulder_button = shoulder_button_none,
+         .thumbstick_left = thumbstick_normal,
+         .thumbstick_right = thumbstick_normal,
+         .trigger_left = trigger_normal,
+         .trigger_right = trigger_normal,
+         .flips_y_axis = kind != personality_wheel,
+         .scales_axes = false,
+         .button_codes = personality->button_codes,
+         .axis_codes = personality->axis_codes,
+         .device_settings = &personality->device_settings,
+      };
+   }
+}
+
+/** Picks the translator for the final options, must run after process_options() and setup_personalities().
+ *  Also sizes the event buffer for the mapping which emits the most events.
+ */
+static void select_translator()
+{
+   translation = (struct TranslationConfig){
+      .shoulder_button = uses_shoulder_button,
+      .thumbstick_left = uses_thumbstick_left,
+      .thumbstick_right = uses_thumbstick_right,
+      .trigger_left = uses_trigger_left,
+      .trigger_right = uses_trigger_right,
+      .flips_y_axis = flips_y_axis,
+      .scales_axes = false,
+      .button_codes = button_code_values,
+      .axis_codes = axis_code_values,
+      .device_settings = &uinput_dev,
+   };
+   for (int code = 0; code < ABS_CNT; code++)
+      translation.scales_axes |= axis_scales[code] != NULL;
+
+   translate_report = uses_raw_mode ? translate_report_raw : translate_report_generic;
+   for (size_t i = 0; !uses_raw_mode && i < sizeof(specialized_translators) / sizeof(specialized_translators[0]); i++)
+   {
+      if (is_same_translation(&translation, specialized_translators[i].config))
+      {
+         translate_report = specialized_translators[i].translate;
+         break;
+      }
+   }
+
+   max_report_events = count_report_events(&translation);
+   for (int p = 0; p < personality_count; p++)
+   {
+      int events = count_report_events(&personalities[p].config);
+      if (events > max_report_events)
+         max_report_events = events;
+   }
+}
+
+#define JITTER_BLOCK_LENGTH 128  // reports per noise measurement
+#define JITTER_REST_SPAN 8        // an input which moves less than this within a block is resting
+#define JITTER_MAX_THRESHOLD 4
+
+// in the order of enum AxisInputIndex
+static const char *jitter_input_names[AXIS_COUNT] = { "LX", "LY", "RX", "RY", "L", "R" };
+
+/** Parses "--jitter-filter": a threshold for all analog inputs, or a comma separated list of assignments to LX, LY, RX, RY, L, R.
+ *  The value is a count of the raw input or "auto" to learn it from the noise while the input rests.
+ */
+static void set_jitter_filter(const char command_line_settings_[])
+{
+   char *command_line_settings = strdup(command_line_settings_);
+
+   for (char *next_item = strtok(command_line_settings, ","); next_item != NULL; next_item = strtok(NULL, ","))
+   {
+      int axis_name_length = strcspn(next_item, "=");
+      char *value_string = next_item;
+      int axis_index = -1;  // all inputs
+      if (next_item[axis_name_length] != '\0')
       {
-         ssize_t write_ret = write(port->uinput, (const char*)events + written, to_write - written);
-         if (write_ret < 0)
+         next_item[axis_name_length] = '\0';
+         value_string = &next_item[axis_name_length + 1];
+         axis_index = 0;
+         while (axis_index < AXIS_COUNT && strcasecmp(next_item, jitter_input_names[axis_index]) != 0)
+            axis_index++;
+         if (axis_index == AXIS_COUNT)
          {
-            perror("Warning: writing input events failed");
-            break;
+            fprintf(stderr, "argument error: unknown input \"%s\" for --jitter-filter, the inputs are LX, LY, RX, RY, L and R\n", next_item);
+            continue;
          }
-         written += write_ret;
+      }
+
+      bool learns = strcmp(value_string, "auto") == 0;
+      char *end = NULL;
+      unsigned long threshold = learns ? 1 : strtoul(value_string, &end, 0);
+      if (!learns && (*end != '\0' || threshold > UINT8_MAX))
+      {
+         fprintf(stderr, "argument error: the threshold \"%s\" for --jitter-filter must be \"auto\" or 0 to %d\n", value_string, UINT8_MAX);
+         continue;
+      }
+      for (int j = 0; j < AXIS_COUNT; j++)
+      {
+         if (axis_index >= 0 && j != axis_index)
+            continue;
+         jitter_thresholds[j] = threshold;
+         learns_jitter[j] = learns;
       }
    }
 
-   // check for rumble events
-   struct input_event e;
-   ssize_t ret = read(port->uinput, &e, sizeof(e));
-   if (ret == sizeof(e))
+   free(command_line_settings);
+
+   uses_jitter_filter = false;
+   for (int j = 0; j < AXIS_COUNT; j++)
+      uses_jitter_filter |= jitter_thresholds[j] > 0 || learns_jitter[j];
+}
+
+/** Parses "--output-rate": a rate in Hz for all ports, or a comma separated list of assignments to the ports 1 to 4.
+ *  0 writes the events of every report right away.
+ */
+static void set_output_rate(const char command_line_settings_[])
+{
+   char *command_line_settings = strdup(command_line_settings_);
+
+   for (char *next_item = strtok(command_line_settings, ","); next_item != NULL; next_item = strtok(NULL, ","))
    {
-      if (e.type == EV_UINPUT)
+      int port_name_length = strcspn(next_item, "=");
+      char *value_string = next_item;
+      int port_index = -1;  // all ports
+      char *end = NULL;
+      if (next_item[port_name_length] != '\0')
       {
-         switch (e.code)
+         next_item[port_name_length] = '\0';
+         value_string = &next_item[port_name_length + 1];
+         port_index = (int)strtoul(next_item, &end, 0) - 1;
+         if (*end != '\0' || end == next_item || port_index < 0 || port_index > 3)
          {
-            case UI_FF_UPLOAD:
-            {
-               struct uinput_ff_upload upload = { 0 };
-               upload.request_id = e.value;
-               ioctl(port->uinput, UI_BEGIN_FF_UPLOAD, &upload);
-               int id = create_ff_event(port, &upload);
-               if (id < 0)
-               {
-                  // TODO: what's the proper error code for this?
-                  upload.retval = -1;
-               }
-               else
-               {
-                  upload.retval = 0;
-                  upload.effect.id = id;
-               }
-               ioctl(port->uinput, UI_END_FF_UPLOAD, &upload);
-               break;
-            }
-            case UI_FF_ERASE:
-            {
-               struct uinput_ff_erase erase = { 0 };
-               erase.request_id = e.value;
-               ioctl(port->uinput, UI_BEGIN_FF_ERASE, &erase);
-               if (erase.effect_id < MAX_FF_EVENTS)
-                  port->ff_events[erase.effect_id].in_use = false;
-               ioctl(port->uinput, UI_END_FF_ERASE, &erase);
-            }
+            fprintf(stderr, "argument error: unknown port \"%s\" for --output-rate, the ports are 1 to 4\n", next_item);
+            continue;
          }
       }
-      else if (e.type == EV_FF)
+
+      // a cap far beyond any adapter, above 1e9 the period would round down to 0, which writes every report
+      unsigned long rate = strtoul(value_string, &end, 0);
+      if (*end != '\0' || end == value_string || rate > 1000000)
+      {
+         fprintf(stderr, "argument error: the rate \"%s\" for --output-rate must be 0 to 1000000 frames per second\n", value_string);
+         continue;
+      }
+      for (int i = 0; i < 4; i++)
+         if (port_index < 0 || i == port_index)
+            output_periods_ns[i] = rate > 0 ? 1000000000LL / rate : 0;
+   }
+
+   free(command_line_settings);
+}
+
+static void reset_jitter_filters(struct ports *port, unsigned char *payload)
+{
+   for (int j = 0; j < AXIS_COUNT; j++)
+   {
+      uint8_t value = payload[3 + j];
+      port->jitter_filter[j] = (struct JitterFilter){
+         .accepted = value, .threshold = jitter_thresholds[j], .block_min = value, .block_max = value, .block_length = 0,
+      };
+   }
+}
+
+// uses the noise of a resting input as its threshold, a moving input keeps the last one
+static void learn_jitter(struct JitterFilter *filter, uint8_t value)
+{
+   if (value < filter->block_min)
+      filter->block_min = value;
+   if (value > filter->block_max)
+      filter->block_max = value;
+   if (++filter->block_length < JITTER_BLOCK_LENGTH)
+      return;
+
+   int span = filter->block_max - filter->block_min;
+   if (span <= JITTER_REST_SPAN)
+   {
+      int threshold = (span + 1) / 2;
+      filter->threshold = threshold < JITTER_MAX_THRESHOLD ? threshold : JITTER_MAX_THRESHOLD;
+   }
+   filter->block_min = filter->block_max = value;
+   filter->block_length = 0;
+}
+
+/** Copies the controller's part of a report to filtered[] and holds back axis changes within the threshold of the last value passed on,
+ *  so a dithering resting stick emits no events. The ends of the range always pass. Returns the number of changes held back.
+ */
+static int filter_jitter(struct ports *port, unsigned char *payload, unsigned char filtered[9])
+{
+   int held_back = 0;
+   memcpy(filtered, payload, 9);
+   for (int j = 0; j < AXIS_COUNT; j++)
+   {
+      struct JitterFilter *filter = &port->jitter_filter[j];
+      uint8_t value = payload[3 + j];
+      if (learns_jitter[j])
+         learn_jitter(filter, value);
+
+      int difference = value > filter->accepted ? value - filter->accepted : filter->accepted - value;
+      if (difference > filter->threshold || value == 0 || value == 255)
+         filter->accepted = value;
+      else if (difference != 0)
+         held_back++;
+      filtered[3 + j] = filter->accepted;
+   }
+   return held_back;
+}
+
+static bool open_state_file()
+{
+   if (state_file_path == NULL)
+   {
+      // no reader, so the reports skip the sequence lock writes
+      if (!reads_ports)
+         return true;
+
+      void *memory = mmap(NULL, sizeof(struct GcStateFile), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (memory == MAP_FAILED)
+      {
+         fprintf(stderr, "cannot map the port states: %s\n", strerror(errno));
+         return false;
+      }
+      state_file = memory;
+      return true;
+   }
+
+   int fd = open(state_file_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0)
+   {
+      fprintf(stderr, "cannot open state file %s: %s\n", state_file_path, strerror(errno));
+      return false;
+   }
+
+   if (ftruncate(fd, sizeof(struct GcStateFile)) != 0)
+   {
+      fprintf(stderr, "cannot resize state file %s: %s\n", state_file_path, strerror(errno));
+      close(fd);
+      return false;
+   }
+
+   void *mapping = mmap(NULL, sizeof(struct GcStateFile), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if (mapping == MAP_FAILED)
+   {
+      fprintf(stderr, "cannot map state file %s: %s\n", state_file_path, strerror(errno));
+      return false;
+   }
+
+   state_file = mapping;
+   state_file->version = GC_STATE_VERSION;
+   state_file->max_adapters = GC_STATE_MAX_ADAPTERS;
+   state_file->ports_per_adapter = GC_STATE_PORTS;
+   state_file->port_state_size = sizeof(struct GcPortState);
+   state_file->writer_pid = getpid();
+   __atomic_store_n(&state_file->magic, GC_STATE_MAGIC, __ATOMIC_RELEASE);
+   return true;
+}
+
+static void close_state_file()
+{
+   if (state_file == NULL)
+      return;
+
+   __atomic_store_n(&state_file->magic, 0, __ATOMIC_RELEASE);
+   munmap(state_file, sizeof(struct GcStateFile));
+   state_file = NULL;
+   if (state_file_path != NULL)
+      unlink(state_file_path);
+}
+
+// the adapter number is the slot, adapters beyond GC_STATE_MAX_ADAPTERS are not published
+static void claim_state_slot(struct adapter *a)
+{
+   a->state_index = -1;
+   if (state_file == NULL)
+      return;
+
+   if (a->id >= GC_STATE_MAX_ADAPTERS)
+   {
+      fprintf(stderr, "state file is full, adapter %03d/%03d is not published\n", a->bus_number, a->device_address);
+      return;
+   }
+
+   struct GcAdapterState *adapter_state = &state_file->adapters[a->id];
+   memset(adapter_state->ports, 0, sizeof(adapter_state->ports));
+   adapter_state->bus_number = a->bus_number;
+   adapter_state->device_address = a->device_address;
+   __atomic_store_n(&adapter_state->present, 1, __ATOMIC_RELEASE);
+
+   a->state_index = a->id;
+   for (int j = 0; j < 4; j++)
+      a->controllers[j].state = &adapter_state->ports[j];
+}
+
+static void release_state_slot(struct adapter *a)
+{
+   if (state_file == NULL || a->state_index < 0)
+      return;
+
+   __atomic_store_n(&state_file->adapters[a->state_index].present, 0, __ATOMIC_RELEASE);
+   for (int j = 0; j < 4; j++)
+      a->controllers[j].state = NULL;
+   a->state_index = -1;
+}
+
+static void decode_port_state(struct GcPortState *state, unsigned char *payload, struct timespec *current_time)
+{
+   state->status = payload[0];
+   state->type = connected_type(payload[0]);
+   state->extra_power = (payload[0] & 0x04) != 0;
+   state->buttons = (uint16_t) payload[1] << 8 | (uint16_t) payload[2];
+   memcpy(state->axis, &payload[3], sizeof(state->axis));
+   state->timestamp_ns = ts_to_ns(current_time);
+}
+
+// sequence lock writer, see gc_state_read_port()
+static void publish_port_state(struct GcPortState *state, unsigned char *payload, struct timespec *current_time)
+{
+   uint32_t sequence = state->sequence;
+   __atomic_store_n(&state->sequence, sequence + 1, __ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+
+   decode_port_state(state, payload, current_time);
+
+   __atomic_store_n(&state->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+static void notify_port_callback(struct ports *port, int i, unsigned char *payload, struct timespec *current_time)
+{
+   struct GcPortState state = { 0 };
+   decode_port_state(&state, payload, current_time);
+   port_callback(port_callback_data, port->adapter_id, i, &state);
+}
+
+// subscriber stream: adapter threads serialize every frame once into a shared ring, a separate thread fans it out to the subscribers
+
+#define STREAM_RING_SIZE 4096  // power of two
+#define STREAM_MAX_SUBSCRIBERS 16
+#define STREAM_MAX_ADAPTERS 16
+#define STREAM_MAX_SKIPS 64  // consecutive full socket buffers until a subscriber is dropped
+
+struct StreamSlot {
+   uint64_t sequence;  // 2 * ticket + 1 while written, 2 * ticket + 2 when complete
+   struct GcStreamFrame frame;
+};
+
+struct StreamSubscriber {
+   int fd;
+   int consecutive_skips;
+};
+
+static struct StreamSlot stream_ring[STREAM_RING_SIZE];
+static uint64_t stream_head;  // next ticket to hand out to a producer
+static int stream_subscriber_count;  // producers skip all work while no one listens
+static int stream_sleeping;  // the fan-out thread waits for stream_eventfd
+static int stream_eventfd = -1;
+static int stream_listen_fd = -1;
+static volatile bool stream_quitting;
+static pthread_t stream_thread;
+
+static struct StreamStats {
+   uint64_t frames_published;
+   uint64_t frames_overwritten;  // the fan-out thread was too slow for the ring
+   uint64_t frames_skipped;      // a subscriber's socket buffer was full
+   uint64_t subscribers_dropped;
+} stream_stats;
+
+// never blocks, the producer either gets a slot or overwrites the oldest one
+// connect and disconnect frames are always published because the fan-out thread replays them to new subscribers
+static void publish_stream_frame(uint8_t kind, uint8_t adapter_id, uint8_t port_index, unsigned char *payload, struct timespec *current_time)
+{
+   if (stream_listen_fd < 0)
+      return;
+   if (kind == gc_frame_state && __atomic_load_n(&stream_subscriber_count, __ATOMIC_RELAXED) == 0)
+      return;
+
+   uint64_t ticket = __atomic_fetch_add(&stream_head, 1, __ATOMIC_SEQ_CST);
+   struct StreamSlot *slot = &stream_ring[ticket & (STREAM_RING_SIZE - 1)];
+
+   __atomic_store_n(&slot->sequence, 2 * ticket + 1, __ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+
+   struct GcStreamFrame *frame = &slot->frame;
+   frame->sequence = (uint32_t)ticket;
+   frame->kind = kind;
+   frame->adapter = adapter_id;
+   frame->port = port_index;
+   frame->status = payload[0];
+   frame->type = connected_type(payload[0]);
+   frame->extra_power = (payload[0] & 0x04) != 0;
+   frame->buttons = (uint16_t) payload[1] << 8 | (uint16_t) payload[2];
+   memcpy(frame->axis, &payload[3], sizeof(frame->axis));
+   frame->timestamp_ns = ts_to_ns(current_time);
+
+   // sequentially consistent like stream_sleeping, so the fan-out thread either sees the slot complete or gets woken
+   __atomic_store_n(&slot->sequence, 2 * ticket + 2, __ATOMIC_SEQ_CST);
+   __atomic_fetch_add(&stream_stats.frames_published, 1, __ATOMIC_RELAXED);
+
+   if (__atomic_load_n(&stream_sleeping, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&stream_sleeping, 0, __ATOMIC_SEQ_CST))
+   {
+      uint64_t one = 1;
+      ssize_t ret = write(stream_eventfd, &one, sizeof(one));
+      (void)ret;
+   }
+}
+
+static void publish_stream_disconnect(uint8_t adapter_id, uint8_t port_index, struct timespec *current_time)
+{
+   unsigned char empty_payload[9] = { 0 };
+   publish_stream_frame(gc_frame_disconnect, adapter_id, port_index, empty_payload, current_time);
+}
+
+// state frames are only sent for changes
+static void publish_stream_changes(struct ports *port, uint8_t port_index, unsigned char *payload, struct timespec *current_time)
+{
+   if (__atomic_load_n(&stream_subscriber_count, __ATOMIC_RELAXED) == 0)
+      return;
+   if (memcmp(port->stream_payload, payload, sizeof(port->stream_payload)) == 0)
+      return;
+
+   memcpy(port->stream_payload, payload, sizeof(port->stream_payload));
+   publish_stream_frame(gc_frame_state, port->adapter_id, port_index, payload, current_time);
+}
+
+static bool open_stream_socket()
+{
+   struct sockaddr_un address = { .sun_family = AF_UNIX };
+   if (strlen(stream_socket_path) >= sizeof(address.sun_path))
+   {
+      fprintf(stderr, "subscriber socket path too long: %s\n", stream_socket_path);
+      return false;
+   }
+   strcpy(address.sun_path, stream_socket_path);
+
+   stream_listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+   if (stream_listen_fd < 0)
+   {
+      perror("cannot create subscriber socket");
+      return false;
+   }
+
+   unlink(stream_socket_path);
+   if (bind(stream_listen_fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(stream_listen_fd, STREAM_MAX_SUBSCRIBERS) != 0)
+   {
+      fprintf(stderr, "cannot listen on %s: %s\n", stream_socket_path, strerror(errno));
+      close(stream_listen_fd);
+      stream_listen_fd = -1;
+      return false;
+   }
+
+   stream_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (stream_eventfd < 0)
+   {
+      perror("cannot create eventfd for the subscriber socket");
+      close(stream_listen_fd);
+      stream_listen_fd = -1;
+      return false;
+   }
+   return true;
+}
+
+static void drop_stream_subscriber(struct StreamSubscriber subscribers[], int *subscribers_count, int index)
+{
+   close(subscribers[index].fd);
+   subscribers[index] = subscribers[--*subscribers_count];
+   __atomic_fetch_sub(&stream_subscriber_count, 1, __ATOMIC_RELAXED);
+}
+
+static void send_stream_frames(struct StreamSubscriber *subscriber, struct GcStreamFrame frames[], int frames_count)
+{
+   if (frames_count == 0)
+      return;
+
+   ssize_t ret = send(subscriber->fd, frames, frames_count * sizeof(frames[0]), MSG_DONTWAIT | MSG_NOSIGNAL);
+   if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+   {
+      subscriber->consecutive_skips++;
+      __atomic_fetch_add(&stream_stats.frames_skipped, frames_count, __ATOMIC_RELAXED);
+   }
+   else if (ret < 0)
+      subscriber->consecutive_skips = STREAM_MAX_SKIPS;  // broken connection
+   else
+      subscriber->consecutive_skips = 0;
+}
+
+// whether the fan-out thread has a frame to collect, a slot which a producer still writes only counts once it is complete
+static bool is_stream_frame_ready(uint64_t tail)
+{
+   if (__atomic_load_n(&stream_head, __ATOMIC_SEQ_CST) == tail)
+      return false;
+   // also true for a slot which a later ticket overwrites
+   return __atomic_load_n(&stream_ring[tail & (STREAM_RING_SIZE - 1)].sequence, __ATOMIC_SEQ_CST) >= 2 * tail + 2;
+}
+
+static void *stream_thread_main(__attribute_maybe_unused__ void *data)
+{
+   struct StreamSubscriber subscribers[STREAM_MAX_SUBSCRIBERS];
+   int subscribers_count = 0;
+   // last connect or state frame of every port, replayed to new subscribers
+   struct GcStreamFrame connected_ports[STREAM_MAX_ADAPTERS][4];
+   memset(connected_ports, 0, sizeof(connected_ports));
+   uint64_t tail = 0;
+
+   while (!stream_quitting)
+   {
+      struct pollfd pollfds[2] = {
+         { .fd = stream_listen_fd, .events = POLLIN },
+         { .fd = stream_eventfd, .events = POLLIN },
+      };
+
+      __atomic_store_n(&stream_sleeping, 1, __ATOMIC_SEQ_CST);
+      // the producer of an incomplete slot wakes this thread once it is done, see publish_stream_frame()
+      int timeout = is_stream_frame_ready(tail) ? 0 : -1;
+      if (poll(pollfds, 2, timeout) < 0 && errno != EINTR)
+         break;
+      __atomic_store_n(&stream_sleeping, 0, __ATOMIC_SEQ_CST);
+
+      if (pollfds[1].revents & POLLIN)
+      {
+         uint64_t count;
+         ssize_t ret = read(stream_eventfd, &count, sizeof(count));
+         (void)ret;
+      }
+
+      if (pollfds[0].revents & POLLIN)
+      {
+         int fd = accept4(stream_listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+         if (fd >= 0 && subscribers_count == STREAM_MAX_SUBSCRIBERS)
+         {
+            log_ratelimited("too many subscribers, refusing a new one\n");
+            close(fd);
+         }
+         else if (fd >= 0)
+         {
+            // ports which are connected before the first frame of a subscriber
+            struct GcStreamFrame snapshot[STREAM_MAX_ADAPTERS * 4];
+            int snapshot_count = 0;
+            for (int j = 0; j < STREAM_MAX_ADAPTERS; j++)
+               for (int k = 0; k < 4; k++)
+                  if (connected_ports[j][k].kind != 0)
+                  {
+                     snapshot[snapshot_count] = connected_ports[j][k];
+                     snapshot[snapshot_count].kind = gc_frame_connect;
+                     snapshot_count++;
+                  }
+
+            subscribers[subscribers_count] = (struct StreamSubscriber){ .fd = fd, .consecutive_skips = 0 };
+            for (int j = 0; j < snapshot_count; j += GC_STREAM_MAX_FRAMES_PER_PACKET)
+            {
+               int remaining = snapshot_count - j;
+               send_stream_frames(&subscribers[subscribers_count], &snapshot[j], remaining < GC_STREAM_MAX_FRAMES_PER_PACKET ? remaining : GC_STREAM_MAX_FRAMES_PER_PACKET);
+            }
+            subscribers_count++;
+            __atomic_fetch_add(&stream_subscriber_count, 1, __ATOMIC_RELAXED);
+         }
+      }
+
+      // collect the completed frames in ticket order
+      struct GcStreamFrame frames[GC_STREAM_MAX_FRAMES_PER_PACKET];
+      int frames_count = 0;
+      uint64_t head = __atomic_load_n(&stream_head, __ATOMIC_ACQUIRE);
+      if (head - tail > STREAM_RING_SIZE)
+      {
+         __atomic_fetch_add(&stream_stats.frames_overwritten, head - tail - STREAM_RING_SIZE, __ATOMIC_RELAXED);
+         tail = head - STREAM_RING_SIZE;
+      }
+
+      while (tail != head && frames_count < GC_STREAM_MAX_FRAMES_PER_PACKET)
+      {
+         struct StreamSlot *slot = &stream_ring[tail & (STREAM_RING_SIZE - 1)];
+         uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+         if (sequence < 2 * tail + 2)
+            break;  // the producer is still writing, it wakes this thread when done
+
+         frames[frames_count] = slot->frame;
+         __atomic_thread_fence(__ATOMIC_ACQUIRE);
+         if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != 2 * tail + 2)
+            __atomic_fetch_add(&stream_stats.frames_overwritten, 1, __ATOMIC_RELAXED);
+         else
+         {
+            struct GcStreamFrame *frame = &frames[frames_count++];
+            if (frame->adapter < STREAM_MAX_ADAPTERS)
+            {
+               if (frame->kind == gc_frame_disconnect)
+                  connected_ports[frame->adapter][frame->port].kind = 0;
+               else
+                  connected_ports[frame->adapter][frame->port] = *frame;
+            }
+         }
+         tail++;
+      }
+
+      for (int j = 0; j < subscribers_count; j++)
+         send_stream_frames(&subscribers[j], frames, frames_count);
+
+      for (int j = subscribers_count - 1; j >= 0; j--)
+      {
+         if (subscribers[j].consecutive_skips >= STREAM_MAX_SKIPS)
+         {
+            __atomic_fetch_add(&stream_stats.subscribers_dropped, 1, __ATOMIC_RELAXED);
+            drop_stream_subscriber(subscribers, &subscribers_count, j);
+         }
+      }
+   }
+
+   while (subscribers_count > 0)
+      drop_stream_subscriber(subscribers, &subscribers_count, subscribers_count - 1);
+
+   return NULL;
+}
+
+static bool start_stream_thread()
+{
+   if (!open_stream_socket())
+      return false;
+
+   if (create_thread(&stream_thread, stream_thread_main, NULL) != 0)
+   {
+      fprintf(stderr, "cannot start the subscriber thread\n");
+      return false;
+   }
+   return true;
+}
+
+static void stop_stream_thread()
+{
+   if (stream_listen_fd < 0)
+      return;
+
+   stream_quitting = true;
+   uint64_t one = 1;
+   ssize_t ret = write(stream_eventfd, &one, sizeof(one));
+   (void)ret;
+   pthread_join(stream_thread, NULL);
+
+   fprintf(stderr, "subscriber stream: %llu frames published, %llu overwritten, %llu skipped, %llu subscribers dropped\n",
+      (unsigned long long)stream_stats.frames_published, (unsigned long long)stream_stats.frames_overwritten,
+      (unsigned long long)stream_stats.frames_skipped, (unsigned long long)stream_stats.subscribers_dropped);
+
+   close(stream_listen_fd);
+   close(stream_eventfd);
+   unlink(stream_socket_path);
+   stream_listen_fd = -1;
+}
+
+/** The buttons of a report in the low 16 bits, above them the keys which the translation derives from the axes:
+ *  the trigger keys of --trigger-buttons and the D-pad directions of thumbsticks in a D-pad mode.
+ *  Mirrors add_axis_event() and map_thumbstick_to_dpad(), but without the time-dependent filter of --dpad-*-sensitive,
+ *  which can only hold back a direction.
+ */
+static uint32_t report_key_states(unsigned char *report)
+{
+   const struct TranslationConfig *config = &translation;
+   uint16_t buttons = (uint16_t)report[1] << 8 | (uint16_t)report[2];
+   unsigned char *axes = report + 3;
+   uint32_t states = buttons;
+
+   static const int trigger_indexes[2] = { trigger_l_index, trigger_r_index };
+   static const int shoulder_indexes[2] = { l_button_index, r_button_index };
+   enum TriggerMode trigger_modes[2] = { config->trigger_left, config->trigger_right };
+   for (int t = 0; t < 2; t++)
+   {
+      int axis_index = trigger_indexes[t];
+      int current_axis = config->axis_codes[axis_index].hi;
+      if (trigger_modes[t] != trigger_binary || current_axis < 0)
+         continue;
+
+      enum AxisDivision axis_division = config->axis_codes[axis_index].lo < 0 ? full_axis : upper_half_axis;
+      unsigned char value = signed_to_axis_value(axis_value_to_signed(axes[axis_index]), axis_index, axis_division);
+      bool is_pressed = value > config->device_settings->absmin[current_axis] + 10;
+      if (config->shoulder_button == shoulder_button_nand && (buttons & (1 << shoulder_indexes[t])))
+         is_pressed = false;
+      states |= (uint32_t)is_pressed << (16 + t);
+   }
+
+   static const int thumbstick_indexes[4] = { thumbl_x_index, thumbl_y_index, thumbr_x_index, thumbr_y_index };
+   for (int k = 0; k < 4; k++)
+   {
+      int axis_index = thumbstick_indexes[k];
+      enum ThumbstickMode thumbstick_mode = k < 2 ? config->thumbstick_left : config->thumbstick_right;
+      if (thumbstick_mode == thumbstick_normal || config->axis_codes[axis_index].hi < 0)
+         continue;
+
+      int axis_value = axis_value_to_signed(axes[axis_index]);
+      if (is_dpad_pressed(axis_value, axis_value_to_signed(axes[axis_index ^ 1]), 20))
+         states |= (uint32_t)1 << (18 + 2*k + (axis_value >= 0));
+   }
+   return states;
+}
+
+// whether merging report into merged would lose a button edge, including the derived ones, or a change of the status byte
+static bool must_split_reports(unsigned char *handled, unsigned char *merged, unsigned char *report)
+{
+   if (report[0] != merged[0])
+      return true;
+
+   uint32_t merged_states = report_key_states(merged);
+   uint32_t pending_edges = merged_states ^ report_key_states(handled);
+   uint32_t new_edges = report_key_states(report) ^ merged_states;
+   return (pending_edges & new_edges) != 0;
+}
+
+// appends the timestamp and the SYN_REPORT to the e_count events of a report, returns the new number of events
+static int finish_report_events(struct input_event events[], int e_count, struct timespec *current_time)
+{
+   if (uses_msc_timestamp)
+   {
+      // USB arrival time in microseconds, wraps around like the MSC_TIMESTAMP of the kernel drivers
+      events[e_count].type = EV_MSC;
+      events[e_count].code = MSC_TIMESTAMP;
+      events[e_count].value = (int32_t)(uint32_t)(ts_to_ns(current_time) / 1000);
+      e_count++;
+   }
+   events[e_count].type = EV_SYN;
+   events[e_count].code = SYN_REPORT;
+   e_count++;
+   return e_count;
+}
+
+// appends the events of one report to the output batch of the port, returns their number
+static int translate_into_batch(struct ports *port, unsigned char *payload, struct timespec *current_time)
+{
+   struct input_event *events = &port->output_batch[port->output_batch_length];
+   memset(events, 0, sizeof(events[0]) * max_report_events);
+   int e_count = translate_report(events, port, &port->translated, payload);
+   if (e_count == 0)
+      return 0;
+
+   e_count = finish_report_events(events, e_count, current_time);
+   port->output_batch_length += e_count;
+   return e_count;
+}
+
+// returns the number of write() calls, 0 with the null output
+static int write_all_events(int fd, struct input_event events[], int e_count)
+{
+   size_t to_write = sizeof(events[0]) * e_count;
+   size_t written = 0;
+   int writes = 0;
+   if (output_backend == output_backend_null)
+      return 0;
+
+   while (written < to_write)
+   {
+      writes++;
+      ssize_t write_ret = write(fd, (const char*)events + written, to_write - written);
+      if (write_ret < 0)
+      {
+         log_ratelimited("Warning: writing input events failed: %s\n", strerror(errno));
+         break;
+      }
+      written += write_ret;
+   }
+   return writes;
+}
+
+static void write_input_events(struct ports *port, int fd, struct input_event events[], int e_count)
+{
+   count_metric(port->metrics.events_written, e_count);
+   TRACE_PROBE(events_written, port->adapter_id, port->port_index, fd, e_count);
+
+   PROFILE_BEGIN(write);
+   int writes = write_all_events(fd, events, e_count);
+   count_metric(port->metrics.writes, writes);
+   PROFILE_END(port->profile, stage_write, write);
+}
+
+static void write_output_batch(struct ports *port)
+{
+   int e_count = port->output_batch_length;
+   port->output_batch_length = 0;
+   write_input_events(port, port->uinput, port->output_batch, e_count);
+}
+
+static void reset_personality_outputs(struct ports *port)
+{
+   for (int p = 0; p < personality_count; p++)
+   {
+      struct TranslationState *state = &port->personality_outputs[p].translated;
+      memset(state, 0, sizeof(*state));
+      reset_thumbstick_filters(state);
+   }
+}
+
+// the report which the main device of the port got, translated with the fixed mapping of a personality and written right away
+static void write_personality_events(struct ports *port, int p, unsigned char *payload, struct timespec *current_time)
+{
+   struct PersonalityOutput *output = &port->personality_outputs[p];
+   if (output_backend != output_backend_null && output->uinput < 0)
+      return;
+
+   struct input_event events[max_report_events];
+   memset(events, 0, sizeof(events));
+   int e_count = translate_report_configured(&personalities[p].config, events, port, &output->translated, payload);
+   if (e_count == 0)
+      return;
+
+   e_count = finish_report_events(events, e_count, current_time);
+   count_metric(output->events_written, e_count);
+   TRACE_PROBE(events_written, port->adapter_id, port->port_index, output->uinput, e_count);
+   count_metric(output->writes, write_all_events(output->uinput, events, e_count));
+}
+
+static void reset_output_rate(int i, struct ports *port)
+{
+   port->output_period_ns = output_periods_ns[i];
+   port->next_output_ns = 0;
+   port->has_pending_payload = false;
+   port->has_held_back_changes = false;
+   port->output_batch_length = 0;
+   memset(port->emitted_payload, 0, sizeof(port->emitted_payload));
+}
+
+/** The --output-rate path of handle_payload(): reports only update the pending state of the port, which is translated
+ *  on the first report at or after each multiple of the port's output period. A button which would change a second time
+ *  before the tick closes the pending state into its own frame of the batch, so the tick's single write carries every
+ *  press and release, each in its own SYN_REPORT frame, and the newest axis values.
+ *  A tick without events whose reports had changes held back by the jitter filter counts as a write it saved.
+ */
+static void coalesce_payload(struct ports *port, unsigned char *payload, struct timespec *current_time, int held_back_changes)
+{
+   port->has_held_back_changes |= held_back_changes > 0;
+
+   if (port->has_pending_payload && must_split_reports(port->emitted_payload, port->pending_payload, payload))
+   {
+      if (port->output_batch_length + max_report_events > OUTPUT_BATCH_EVENTS)
+         write_output_batch(port);  // too many edges for one tick
+      translate_into_batch(port, port->pending_payload, &port->pending_time);
+      memcpy(port->emitted_payload, port->pending_payload, sizeof(port->emitted_payload));
+   }
+   else if (port->has_pending_payload)
+      count_metric(port->metrics.coalesced_reports, 1);
+
+   memcpy(port->pending_payload, payload, sizeof(port->pending_payload));
+   port->pending_time = *current_time;
+   port->has_pending_payload = true;
+
+   int64_t now_ns = ts_to_ns(current_time);
+   if (now_ns < port->next_output_ns)
+      return;
+
+   if (port->output_batch_length + max_report_events > OUTPUT_BATCH_EVENTS)
+      write_output_batch(port);
+   translate_into_batch(port, port->pending_payload, &port->pending_time);
+   memcpy(port->emitted_payload, port->pending_payload, sizeof(port->emitted_payload));
+   port->has_pending_payload = false;
+   if (port->output_batch_length > 0)
+      write_output_batch(port);
+   else if (port->has_held_back_changes)
+      count_metric(port->metrics.jitter_writes_saved, 1);
+   port->has_held_back_changes = false;
+   port->next_output_ns = (now_ns / port->output_period_ns + 1) * port->output_period_ns;
+}
+
+// the part of a connect which needs the first report, also run for the ports taken over from the previous instance
+static void start_connected_port(int i, struct ports *port, unsigned char *payload, struct timespec *current_time)
+{
+   port->is_adopted = false;
+   memcpy(port->stream_payload, payload, sizeof(port->stream_payload));
+   reset_jitter_filters(port, payload);
+   publish_stream_frame(gc_frame_connect, port->adapter_id, i, payload, current_time);
+}
+
+static void handle_payload(int i, struct ports *port, unsigned char *payload, struct timespec *current_time)
+{
+   PROFILE_BEGIN(status);
+   unsigned char status = payload[0];
+   unsigned char type = connected_type(status);
+
+   if (port->state != NULL)
+      publish_port_state(port->state, payload, current_time);
+   if (port_callback != NULL && (type != 0 || port->connected))
+      notify_port_callback(port, i, payload, current_time);
+
+   if (type != 0 && !port->connected)
+   {
+      if (output_create(i, port, type))
+      {
+         if (port->adapter_id < GC_STATE_MAX_ADAPTERS)
+            __atomic_store_n(&requested_rumble[port->adapter_id][i], 0, __ATOMIC_RELAXED);
+         count_metric(port->metrics.connects, 1);
+         TRACE_PROBE(port_connected, port->adapter_id, i, type, (status & 0x04) != 0);
+         reset_output_rate(i, port);
+         reset_personality_outputs(port);
+         start_connected_port(i, port, payload, current_time);
+      }
+   }
+   else if (type != 0 && port->is_adopted)
+      start_connected_port(i, port, payload, current_time);
+   else if (type == 0 && port->connected)
+   {
+      port->is_adopted = false;
+      output_destroy(i, port);
+      count_metric(port->metrics.disconnects, 1);
+      TRACE_PROBE(port_disconnected, port->adapter_id, i);
+      publish_stream_disconnect(port->adapter_id, i, current_time);
+   }
+
+   if (!port->connected)
+   {
+      PROFILE_END(port->profile, stage_status, status);
+      return;
+   }
+
+   publish_stream_changes(port, i, payload, current_time);
+
+   port->extra_power = ((status & 0x04) != 0);
+
+   if (type != port->type)
+   {
+      log_ratelimited("controller on port %d changed controller type???\n", i+1);
+      port->type = type;
+   }
+   PROFILE_END(port->profile, stage_status, status);
+
+   if (output_backend == output_backend_none)
+      return;
+
+   unsigned char filtered_payload[9];
+   int held_back_changes = 0;
+   if (uses_jitter_filter)
+   {
+      held_back_changes = filter_jitter(port, payload, filtered_payload);
+      payload = filtered_payload;
+      count_metric(port->metrics.jitter_events_saved, held_back_changes);
+   }
+
+   if (output_backend == output_backend_uhid)
+   {
+      uhid_handle_payload(port, payload, current_time);
+      return;
+   }
+
+   if (port->output_period_ns > 0)
+      coalesce_payload(port, payload, current_time, held_back_changes);
+   else
+   {
+      int e_count = translate_into_batch(port, payload, current_time);
+      if (held_back_changes > 0 && e_count == 0)
+         count_metric(port->metrics.jitter_writes_saved, 1);
+      if (e_count > 0)
+         write_output_batch(port);
+   }
+
+   // the filtered report is decoded once, every personality only maps it
+   for (int p = 0; p < personality_count; p++)
+      write_personality_events(port, p, payload, current_time);
+
+   if (output_backend == output_backend_null)
+      return;
+
+   // check for rumble events
+   PROFILE_BEGIN(ff);
+   struct input_event e;
+   ssize_t ret = read(port->uinput, &e, sizeof(e));
+   if (ret == sizeof(e))
+   {
+      if (e.type == EV_UINPUT)
+      {
+         switch (e.code)
+         {
+            case UI_FF_UPLOAD:
+            {
+               struct uinput_ff_upload upload = { 0 };
+               upload.request_id = e.value;
+               count_metric(port->metrics.ff_uploads, 1);
+               ioctl(port->uinput, UI_BEGIN_FF_UPLOAD, &upload);
+               int id = create_ff_event(port, &upload);
+               TRACE_PROBE(ff_upload, port->adapter_id, i, id, upload.effect.type);
+               if (id < 0)
+               {
+                  // TODO: what's the proper error code for this?
+                  upload.retval = -1;
+               }
+               else
+               {
+                  upload.retval = 0;
+                  upload.effect.id = id;
+               }
+               ioctl(port->uinput, UI_END_FF_UPLOAD, &upload);
+               break;
+            }
+            case UI_FF_ERASE:
+            {
+               struct uinput_ff_erase erase = { 0 };
+               erase.request_id = e.value;
+               count_metric(port->metrics.ff_erases, 1);
+               ioctl(port->uinput, UI_BEGIN_FF_ERASE, &erase);
+               TRACE_PROBE(ff_erase, port->adapter_id, i, erase.effect_id);
+               if (erase.effect_id < MAX_FF_EVENTS)
+                  port->ff_events[erase.effect_id].in_use = false;
+               ioctl(port->uinput, UI_END_FF_ERASE, &erase);
+            }
+         }
+      }
+      else if (e.type == EV_FF)
+      {
+         count_metric(port->metrics.ff_plays, 1);
+         TRACE_PROBE(ff_play, port->adapter_id, i, e.code, e.value);
+         if (e.code < MAX_FF_EVENTS && port->ff_events[e.code].in_use)
+         {
+            port->ff_events[e.code].repetitions = e.value;
+            update_ff_start_stop(&port->ff_events[e.code], current_time);
+         }
+      }
+   }
+   PROFILE_END(port->profile, stage_ff, ff);
+}
+
+// translates the errno values of usbfs into libusb error codes, so that both backends report errors alike
+static int usbfs_error(int error)
+{
+   switch (error)
+   {
+      case ENODEV:
+      case ESHUTDOWN:
+         return LIBUSB_ERROR_NO_DEVICE;
+      case EPIPE:
+         return LIBUSB_ERROR_PIPE;
+      case ETIMEDOUT:
+         return LIBUSB_ERROR_TIMEOUT;
+      case EOVERFLOW:
+         return LIBUSB_ERROR_OVERFLOW;
+      case EINTR:
+      case ENOENT:
+      case ECONNRESET:
+         return LIBUSB_ERROR_INTERRUPTED;
+      case ENOMEM:
+         return LIBUSB_ERROR_NO_MEM;
+      case EACCES:
+      case EPERM:
+         return LIBUSB_ERROR_ACCESS;
+      case EBUSY:
+         return LIBUSB_ERROR_BUSY;
+      case EPROTO:
+      case EILSEQ:
+      case ECOMM:
+      case ENOSR:
+         return LIBUSB_ERROR_IO;
+      default:
+         return LIBUSB_ERROR_OTHER;
+   }
+}
+
+/** Same contract as libusb_interrupt_transfer() (timeout 0 waits forever) but submits and reaps the URB on the usbfs node directly.
+ *  Only one URB is in flight per adapter at any time, so every reaped URB is the one just submitted.
+ */
+static int usbfs_interrupt_transfer(int fd, unsigned char endpoint, unsigned char *data, int length, int *transferred, unsigned int timeout)
+{
+   struct usbdevfs_urb urb = {
+      .type = USBDEVFS_URB_TYPE_INTERRUPT,
+      .endpoint = endpoint,
+      .buffer = data,
+      .buffer_length = length,
+   };
+   struct usbdevfs_urb *reaped = NULL;
+   *transferred = 0;
+
+   if (ioctl(fd, USBDEVFS_SUBMITURB, &urb) != 0)
+      return usbfs_error(errno);
+
+   // completed URBs make the node writable
+   while (ioctl(fd, USBDEVFS_REAPURBNDELAY, &reaped) != 0)
+   {
+      if (errno != EAGAIN)
+         return usbfs_error(errno);
+
+      struct pollfd pollfd = { .fd = fd, .events = POLLOUT };
+      int poll_ret = poll(&pollfd, 1, timeout == 0 ? -1 : (int)timeout);
+      if (poll_ret == 0 || (poll_ret < 0 && errno != EINTR))
+      {
+         int error = (poll_ret == 0) ? LIBUSB_ERROR_TIMEOUT : usbfs_error(errno);
+         // the buffer lives on the caller's stack, wait until the kernel gave it back
+         ioctl(fd, USBDEVFS_DISCARDURB, &urb);
+         ioctl(fd, USBDEVFS_REAPURB, &reaped);
+         return error;
+      }
+   }
+
+   if (urb.status != 0)
+      return usbfs_error(-urb.status);
+
+   *transferred = urb.actual_length;
+   return LIBUSB_SUCCESS;
+}
+
+static bool usbfs_open(struct adapter *a)
+{
+   char path[32];
+   snprintf(path, sizeof(path), "/dev/bus/usb/%03d/%03d", a->bus_number, a->device_address);
+
+   a->usbfs_fd = open(path, O_RDWR);
+   if (a->usbfs_fd < 0)
+   {
+      fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+      return false;
+   }
+
+   // detaches whatever kernel driver is bound to interface 0 and claims it in one step
+   struct usbdevfs_disconnect_claim disconnect_claim = { .interface = 0, .flags = 0, .driver = "" };
+   if (ioctl(a->usbfs_fd, USBDEVFS_DISCONNECT_CLAIM, &disconnect_claim) != 0)
+   {
+      fprintf(stderr, "Error claiming interface 0 of %s: %s\n", path, strerror(errno));
+      close(a->usbfs_fd);
+      a->usbfs_fd = -1;
+      return false;
+   }
+
+   return true;
+}
+
+static int adapter_transfer(struct adapter *a, unsigned char endpoint, unsigned char *data, int length, int *transferred, unsigned int timeout)
+{
+   if (a->backend == usb_backend_usbfs)
+      return usbfs_interrupt_transfer(a->usbfs_fd, endpoint, data, length, transferred, timeout);
+   if (a->backend == usb_backend_simulated)
+   {
+      if (endpoint == EP_IN)
+         return a->simulation->read_report(a->simulation, data, length, transferred, timeout);
+      return a->simulation->write_command(a->simulation, data, length, transferred, timeout);
+   }
+
+   return libusb_interrupt_transfer(a->handle, endpoint, data, length, transferred, timeout);
+}
+
+static bool adapter_open(struct adapter *a)
+{
+   if (a->backend == usb_backend_usbfs)
+      return usbfs_open(a);
+   if (a->backend == usb_backend_simulated)
+      return true;
+
+   if (a->handle == NULL && libusb_open(a->device, &a->handle) != 0)
+   {
+      fprintf(stderr, "Error opening device %p\n", a->device);
+      return false;
+   }
+
+   if (libusb_kernel_driver_active(a->handle, 0) == 1) {
+       fprintf(stderr, "Detaching kernel driver\n");
+       if (libusb_detach_kernel_driver(a->handle, 0)) {
+           fprintf(stderr, "Error detaching handle %p from kernel\n", a->handle);
+           libusb_close(a->handle);
+           return false;
+       }
+   }
+
+   // thanks to https://github.com/dperelman/wii-u-gc-adapter
+   if (uses_explicit_libusb_claim)
+   {
+      int tries_count = 0;
+      while(libusb_claim_interface(a->handle, 0) != 0)
+      {
+         fprintf(stderr, "Error claiming interface 0 on adapter %#x from kernel, retry in 3 seconds\n", a->handle);
+         sleep(3);
+         fprintf(stderr, "\x1b[A(%d) ", ++tries_count); // thanks to https://stackoverflow.com/a/25103053
+      }
+   }
+
+   return true;
+}
+
+static void adapter_release(struct adapter *a)
+{
+   if (a->backend == usb_backend_libusb && uses_explicit_libusb_claim)
+      libusb_release_interface(a->handle, 0);
+}
+
+static void adapter_close(struct adapter *a)
+{
+   if (a->backend == usb_backend_usbfs)
+   {
+      // closing the node also releases the claimed interface
+      close(a->usbfs_fd);
+      a->usbfs_fd = -1;
+   }
+   else if (a->backend == usb_backend_libusb)
+   {
+      libusb_close(a->handle);
+      a->handle = NULL;
+      // libusb leaves a wrapped node open
+      if (a->usbfs_fd >= 0)
+         close(a->usbfs_fd);
+      a->usbfs_fd = -1;
+   }
+}
+
+static int adapter_send_init(struct adapter *a)
+{
+   int bytes_transferred;
+   unsigned char payload[1] = { 0x13 };
+
+   int transfer_ret = adapter_transfer(a, EP_OUT, payload, sizeof(payload), &bytes_transferred, usb_timeout);
+
+   if (transfer_ret != 0) {
+      log_ratelimited("libusb_interrupt_transfer: %s\n", libusb_error_name(transfer_ret));
+      return transfer_ret;
+   }
+   if (bytes_transferred != sizeof(payload)) {
+      log_ratelimited("libusb_interrupt_transfer %d/%d bytes transferred.\n", bytes_transferred, sizeof(payload));
+      return LIBUSB_ERROR_IO;
+   }
+   return LIBUSB_SUCCESS;
+}
+
+static int adapter_clear_halt(struct adapter *a, unsigned char endpoint)
+{
+   if (a->backend == usb_backend_simulated)
+      return LIBUSB_SUCCESS;
+   if (a->backend == usb_backend_usbfs)
+   {
+      unsigned int usbfs_endpoint = endpoint;
+      return ioctl(a->usbfs_fd, USBDEVFS_CLEAR_HALT, &usbfs_endpoint) == 0 ? LIBUSB_SUCCESS : usbfs_error(errno);
+   }
+   return libusb_clear_halt(a->handle, endpoint);
+}
+
+// the kernel driver may bind again after a reset, so it is detached again
+static int adapter_reset(struct adapter *a)
+{
+   if (a->backend == usb_backend_simulated)
+      return LIBUSB_SUCCESS;
+   if (a->backend == usb_backend_usbfs)
+   {
+      if (ioctl(a->usbfs_fd, USBDEVFS_RESET, NULL) != 0)
+         return usbfs_error(errno);
+      struct usbdevfs_disconnect_claim disconnect_claim = { .interface = 0, .flags = 0, .driver = "" };
+      ioctl(a->usbfs_fd, USBDEVFS_DISCONNECT_CLAIM, &disconnect_claim);
+      return LIBUSB_SUCCESS;
+   }
+
+   int reset_ret = libusb_reset_device(a->handle);
+   if (reset_ret == LIBUSB_SUCCESS && libusb_kernel_driver_active(a->handle, 0) == 1)
+      libusb_detach_kernel_driver(a->handle, 0);
+   return reset_ret;
+}
+
+enum UsbErrorClass {
+   usb_error_transient,  // worth an immediate retry
+   usb_error_stall,      // the endpoint halted, needs a clear halt
+   usb_error_gone,       // the adapter was unplugged, the hotplug callback removes it
+   usb_error_fault,      // retries alone are unlikely to help, escalate
+};
+
+static enum UsbErrorClass classify_usb_error(int error)
+{
+   switch (error)
+   {
+      case LIBUSB_ERROR_TIMEOUT:
+      case LIBUSB_ERROR_INTERRUPTED:
+      case LIBUSB_ERROR_OVERFLOW:
+      case LIBUSB_ERROR_BUSY:
+      case LIBUSB_ERROR_NO_MEM:
+         return usb_error_transient;
+      case LIBUSB_ERROR_PIPE:
+         return usb_error_stall;
+      case LIBUSB_ERROR_NO_DEVICE:
+      case LIBUSB_ERROR_NOT_FOUND:
+         return usb_error_gone;
+      default:
+         return usb_error_fault;
+   }
+}
+
+#define RECOVERY_FIRST_DELAY_US 250
+#define RECOVERY_MAX_DELAY_US 1000000
+#define RECOVERY_LADDER_LENGTH 8  // errors per round of escalation
+
+enum RecoveryStep {
+   recovery_clear_halt,
+   recovery_reset,
+   recovery_reinit,
+   recovery_steps_count,
+};
+
+struct UsbRecovery {
+   int consecutive_errors;
+   enum RecoveryStep watchdog_step;  // the next step when the watchdog expires
+};
+
+// sleeps in slices so that removing the adapter does not wait for a long backoff or idle interval
+static void adapter_sleep(struct adapter *a, int delay_us)
+{
+   while (delay_us > 0 && !a->quitting)
+   {
+      int slice_us = delay_us < 100000 ? delay_us : 100000;
+      struct timespec slice = { .tv_sec = 0, .tv_nsec = slice_us * 1000L };
+      nanosleep(&slice, NULL);
+      delay_us -= slice_us;
+   }
+}
+
+static int perform_recovery_step(struct adapter *a, enum RecoveryStep step, int errors)
+{
+   int step_ret = LIBUSB_SUCCESS;
+   switch (step)
+   {
+      case recovery_clear_halt:
+         log_ratelimited("adapter %p: clearing halt (%d errors in a row)\n", a->device, errors);
+         count_metric(a->metrics.clear_halts, 1);
+         step_ret = adapter_clear_halt(a, EP_IN);
+         if (step_ret == LIBUSB_SUCCESS)
+            step_ret = adapter_clear_halt(a, EP_OUT);
+         break;
+      case recovery_reset:
+         log_ratelimited("adapter %p: resetting device (%d errors in a row)\n", a->device, errors);
+         count_metric(a->metrics.resets, 1);
+         step_ret = adapter_reset(a);
+         break;
+      case recovery_reinit:
+         log_ratelimited("adapter %p: sending init again (%d errors in a row)\n", a->device, errors);
+         count_metric(a->metrics.reinits, 1);
+         step_ret = adapter_send_init(a);
+         memset(a->rumble, 0, sizeof(a->rumble));  // the adapter forgot the rumble state
+         break;
+      default:
+         break;
+   }
+   return step_ret;
+}
+
+static bool is_adapter_gone(struct adapter *a, int error)
+{
+   if (classify_usb_error(error) != usb_error_gone)
+      return false;
+
+   log_message("adapter %p is gone (%s)\n", a->device, libusb_error_name(error));
+   return true;
+}
+
+/** Decides how the adapter thread continues after a failed transfer, the ports and their input devices stay untouched.
+ *  Every error is retried after an exponential backoff starting below a millisecond. Errors which keep coming escalate
+ *  within each round of RECOVERY_LADDER_LENGTH errors: clear halt of both endpoints, then a device reset, then the 0x13 init again.
+ *  Returns false when the thread should stop.
+ */
+static bool recover_from_transfer_error(struct adapter *a, struct UsbRecovery *recovery, int error)
+{
+   if (quits_on_interrupt)
+      return false;
+
+   enum UsbErrorClass error_class = classify_usb_error(error);
+   if (is_adapter_gone(a, error))
+      return false;
+
+   int errors = ++recovery->consecutive_errors;
+   int ladder_position = (errors - 1) % RECOVERY_LADDER_LENGTH;
+   int shift = errors - 1 < 12 ? errors - 1 : 12;
+   int delay_us = RECOVERY_FIRST_DELAY_US << shift;
+   if (delay_us > RECOVERY_MAX_DELAY_US)
+      delay_us = RECOVERY_MAX_DELAY_US;
+
+   adapter_sleep(a, delay_us);
+   if (a->quitting)
+      return false;
+
+   int step_ret = LIBUSB_SUCCESS;
+   if ((error_class == usb_error_stall && errors == 1) || ladder_position == 2)
+      step_ret = perform_recovery_step(a, recovery_clear_halt, errors);
+   else if (error_class != usb_error_transient && ladder_position == 4)
+      step_ret = perform_recovery_step(a, recovery_reset, errors);
+   else if (ladder_position == 6)
+      step_ret = perform_recovery_step(a, recovery_reinit, errors);
+
+   return !is_adapter_gone(a, step_ret);
+}
+
+/** Called when a transfer brought no valid report. An adapter always streams reports, so a silence longer than the
+ *  watchdog window means it is stuck. Each expiry takes the next recovery step right away. Returns false when the thread should stop.
+ */
+static bool check_watchdog(struct adapter *a, struct UsbRecovery *recovery)
+{
+   if (watchdog_window == 0)
+      return true;
+
+   int64_t now_ns = clock_ns(CLOCK_MONOTONIC);
+   int64_t silence_ns = now_ns - __atomic_load_n(&a->last_report_ns, __ATOMIC_RELAXED);
+   if (silence_ns < watchdog_window * 1000000LL)
+      return true;
+
+   log_ratelimited("adapter %p: no report for %lld ms\n", a->device, (long long)(silence_ns / 1000000));
+   count_metric(a->metrics.watchdog_expirations, 1);
+   __atomic_store_n(&a->last_report_ns, now_ns, __ATOMIC_RELAXED);  // the next expiry is one window later
+
+   int step_ret = perform_recovery_step(a, recovery->watchdog_step, recovery->consecutive_errors);
+   recovery->watchdog_step = (recovery->watchdog_step + 1) % recovery_steps_count;
+   return !is_adapter_gone(a, step_ret);
+}
+
+static void recovery_succeeded(struct adapter *a, struct UsbRecovery *recovery)
+{
+   if (recovery->consecutive_errors == 0)
+      return;
+
+   log_message("adapter %p recovered after %d errors\n", a->device, recovery->consecutive_errors);
+   recovery->consecutive_errors = 0;
+   recovery->watchdog_step = recovery_clear_halt;
+}
+
+static bool has_any_port_connected(struct adapter *a)
+{
+   return a->controllers[0].connected || a->controllers[1].connected || a->controllers[2].connected || a->controllers[3].connected;
+}
+
+static bool reports_any_controller(unsigned char *payload)
+{
+   return (connected_type(payload[1]) | connected_type(payload[10]) | connected_type(payload[19]) | connected_type(payload[28])) != 0;
+}
+
+// counts and logs a failed transfer, then recovers from it or lets the adapter quit
+static void handle_transfer_error(struct adapter *a, struct UsbRecovery *recovery, int transfer_ret)
+{
+   count_metric(a->metrics.usb_errors[usb_error_index(transfer_ret)], 1);
+   TRACE_PROBE(transfer_error, a->id, transfer_ret);
+   log_ratelimited("libusb_interrupt_transfer error %d\n", transfer_ret);
+   if (!recover_from_transfer_error(a, recovery, transfer_ret))
+      a->quitting = true;
+}
+
+// reaps the next report of the adapter, returns false if the transfer brought no valid report
+static bool receive_report(struct adapter *a, struct UsbRecovery *recovery, unsigned char payload[37])
+{
+   int size = 0;
+   // bounded, so that the thread notices a->quitting and the watchdog soon enough
+   PROFILE_BEGIN(usb_reap);
+   int transfer_ret = adapter_transfer(a, EP_IN, payload, 37, &size, usb_timeout);
+   PROFILE_END(a->profile, stage_usb_reap, usb_reap);
+   if (transfer_ret == LIBUSB_ERROR_TIMEOUT) {
+      count_metric(a->metrics.in_timeouts, 1);
+      if (!check_watchdog(a, recovery))
+         a->quitting = true;
+      return false;
+   }
+   if (transfer_ret != 0) {
+      handle_transfer_error(a, recovery, transfer_ret);
+      return false;
+   }
+   if (size != 37 || payload[0] != 0x21)
+   {
+      count_metric(a->metrics.packets_dropped, 1);
+      if (!check_watchdog(a, recovery))
+         a->quitting = true;
+      return false;
+   }
+   count_metric(a->metrics.packets_received, 1);
+   TRACE_PROBE(report_received, a->id, payload, size);
+   recovery_succeeded(a, recovery);
+   return true;
+}
+
+static void translate_adapter_report(struct adapter *a, unsigned char *payload, struct timespec *current_time)
+{
+   unsigned char *controller = &payload[1];
+   for (int i = 0; i < 4; i++, controller += 9)
+      handle_payload(i, &a->controllers[i], controller, current_time);
+}
+
+// the rumble state which the force feedback effects of the ports ask for at current_time
+static void evaluate_rumble(struct adapter *a, struct timespec *current_time, unsigned char rumble[5])
+{
+   rumble[0] = 0x11;
+   for (int i = 0; i < 4; i++)
+   {
+      rumble[i+1] = 0;
+      if (a->controllers[i].extra_power && a->controllers[i].type == STATE_NORMAL)
+      {
+         if (a->id < GC_STATE_MAX_ADAPTERS && __atomic_load_n(&requested_rumble[a->id][i], __ATOMIC_RELAXED))
+            rumble[i+1] = 1;
+         for (int j = 0; j < MAX_FF_EVENTS; j++)
+         {
+            struct ff_event *e = &a->controllers[i].ff_events[j];
+            if (e->in_use)
+            {
+               bool after_start = ts_lessthan(&e->start_time, current_time);
+               bool before_end = ts_greaterthan(&e->end_time, current_time);
+
+               if (after_start && before_end)
+                  rumble[i+1] = 1;
+               else if (after_start && !before_end)
+                  update_ff_start_stop(e, current_time);
+            }
+         }
+      }
+   }
+}
+
+// sends the rumble state if it differs from the adapter's, returns the libusb code of the transfer
+static int update_rumble(struct adapter *a, unsigned char rumble[5])
+{
+   if (memcmp(rumble, a->rumble, sizeof(a->rumble)) == 0)
+      return LIBUSB_SUCCESS;
+
+   int size = 0;
+   memcpy(a->rumble, rumble, sizeof(a->rumble));
+   count_metric(a->metrics.rumble_transfers, 1);
+   TRACE_PROBE(rumble_changed, a->id, rumble[1], rumble[2], rumble[3], rumble[4]);
+   return adapter_transfer(a, EP_OUT, a->rumble, sizeof(a->rumble), &size, usb_timeout);
+}
+
+static void destroy_adapter_outputs(struct adapter *a)
+{
+   if (a->keeps_outputs)
+      return;
+
+   struct timespec current_time = { 0 };
+   clock_gettime(CLOCK_MONOTONIC_RAW, &current_time);
+   for (int i = 0; i < 4; i++)
+   {
+      if (a->controllers[i].connected)
+      {
+         output_destroy(i, &a->controllers[i]);
+         publish_stream_disconnect(a->id, i, &current_time);
+      }
+   }
+}
+
+// reads, translates and answers with rumble in one thread, one report after the other
+static void run_adapter_loop(struct adapter *a, struct UsbRecovery *recovery)
+{
+   unsigned int idle_reports = 0;
+
+   while (!a->quitting)
+   {
+      unsigned char payload[37];
+      if (!receive_report(a, recovery, payload))
+         continue;
+
+      if (!has_any_port_connected(a) && !reports_any_controller(payload))
+      {
+         // all ports empty: only the status bytes matter until a controller is plugged in,
+         // the watchdog's clock is read on every 16th report only
+         count_metric(a->metrics.idle_reports, 1);
+         if (idle_interval > 0 || (++idle_reports & 15) == 0)
+            __atomic_store_n(&a->last_report_ns, clock_ns(CLOCK_MONOTONIC), __ATOMIC_RELAXED);
+         if (idle_interval > 0)
+            adapter_sleep(a, idle_interval * 1000);
+         continue;
+      }
+      __atomic_store_n(&a->last_report_ns, clock_ns(CLOCK_MONOTONIC), __ATOMIC_RELAXED);
+
+      unsigned char rumble[5];
+      struct timespec current_time = { 0 };
+      clock_gettime(CLOCK_MONOTONIC_RAW, &current_time);
+      translate_adapter_report(a, payload, &current_time);
+
+      PROFILE_BEGIN(rumble);
+      evaluate_rumble(a, &current_time, rumble);
+      int transfer_ret = update_rumble(a, rumble);
+      PROFILE_END(a->profile, stage_rumble, rumble);
+
+      if (transfer_ret != 0)
+         handle_transfer_error(a, recovery, transfer_ret);
+   }
+
+   destroy_adapter_outputs(a);
+}
+
+static void wake_translator(struct ReportPipeline *pipeline)
+{
+   if (__atomic_load_n(&pipeline->translator_sleeping, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&pipeline->translator_sleeping, 0, __ATOMIC_SEQ_CST))
+   {
+      uint64_t one = 1;
+      ssize_t ret = write(pipeline->eventfd, &one, sizeof(one));
+      (void)ret;
+   }
+}
+
+// never blocks, a report which finds the ring full is dropped and counted
+static void push_report(struct adapter *a, unsigned char *payload, struct timespec *arrival)
+{
+   struct ReportPipeline *pipeline = &a->pipeline;
+   uint32_t head = pipeline->head;
+   uint32_t depth = head - __atomic_load_n(&pipeline->tail, __ATOMIC_ACQUIRE);
+   if (depth >= REPORT_RING_SIZE)
+   {
+      count_metric(a->metrics.pipeline_overflows, 1);
+      return;
+   }
+   if (depth + 1 > a->metrics.pipeline_depth_max)
+      __atomic_store_n(&a->metrics.pipeline_depth_max, depth + 1, __ATOMIC_RELAXED);
+
+   struct ReportSlot *slot = &pipeline->slots[head & (REPORT_RING_SIZE - 1)];
+   slot->arrival = *arrival;
+   memcpy(slot->payload, payload, sizeof(slot->payload));
+   __atomic_store_n(&pipeline->head, head + 1, __ATOMIC_SEQ_CST);
+
+   wake_translator(pipeline);
+}
+
+/** The USB thread of pipelined mode: reaps and timestamps reports, pushes them to the translator thread and sends
+ *  the rumble state which the translator thread asks for. Nothing in here waits for uinput, uhid or the translation.
+ */
+static void run_pipelined_adapter_loop(struct adapter *a, struct UsbRecovery *recovery)
+{
+   struct ReportPipeline *pipeline = &a->pipeline;
+
+   while (!a->quitting)
+   {
+      unsigned char payload[37];
+      if (!receive_report(a, recovery, payload))
+         continue;
+
+      struct timespec arrival = { 0 };
+      clock_gettime(CLOCK_MONOTONIC_RAW, &arrival);
+      __atomic_store_n(&a->last_report_ns, clock_ns(CLOCK_MONOTONIC), __ATOMIC_RELAXED);
+      push_report(a, payload, &arrival);
+
+      unsigned char rumble[5] = { 0x11 };
+      uint32_t rumble_request = __atomic_load_n(&pipeline->rumble_request, __ATOMIC_RELAXED);
+      memcpy(&rumble[1], &rumble_request, sizeof(rumble_request));
+      int transfer_ret = update_rumble(a, rumble);
+      if (transfer_ret != 0)
+         handle_transfer_error(a, recovery, transfer_ret);
+
+      if (idle_interval > 0 && !__atomic_load_n(&pipeline->has_port_connected, __ATOMIC_RELAXED) && !reports_any_controller(payload))
+         adapter_sleep(a, idle_interval * 1000);
+   }
+
+   // the translator thread is waiting for more reports
+   a->quitting = true;
+   uint64_t one = 1;
+   ssize_t ret = write(pipeline->eventfd, &one, sizeof(one));
+   (void)ret;
+}
+
+static struct ReportSlot *report_slot(struct ReportPipeline *pipeline, uint32_t index)
+{
+   return &pipeline->slots[index & (REPORT_RING_SIZE - 1)];
+}
+
+/** Hands the reports first to end - 1 of the ring to the ports as few reports as possible. Consecutive reports of a port
+ *  are merged as long as no button would change twice and the status byte stays the same, so every button press and release
+ *  still arrives in order while the axes jump to their latest values and each merged run costs one write and one SYN_REPORT.
+ */
+static void translate_backlog(struct adapter *a, uint32_t first, uint32_t end)
+{
+   struct ReportPipeline *pipeline = &a->pipeline;
+   for (int i = 0; i < 4; i++)
+   {
+      struct ports *port = &a->controllers[i];
+      unsigned char *handled = &pipeline->handled_payload[1 + 9*i];
+      unsigned char merged[9];
+      struct timespec *merged_time = NULL;
+
+      for (uint32_t k = first; k != end; k++)
+      {
+         struct ReportSlot *slot = report_slot(pipeline, k);
+         unsigned char *report = &slot->payload[1 + 9*i];
+         if (merged_time != NULL)
+         {
+            if (must_split_reports(handled, merged, report))
+            {
+               handle_payload(i, port, merged, merged_time);
+               memcpy(handled, merged, sizeof(merged));
+            }
+            else if (port->connected)
+               count_metric(port->metrics.collapsed_reports, 1);
+         }
+         memcpy(merged, report, sizeof(merged));
+         merged_time = &slot->arrival;
+      }
+
+      handle_payload(i, port, merged, merged_time);
+      memcpy(handled, merged, sizeof(merged));
+   }
+}
+
+/** The translator thread of pipelined mode: translates the reports in the order the USB thread reaped them,
+ *  writes the input events, reads the force feedback requests and owns the output devices of the ports.
+ *  With --catch-up it takes all reports which piled up at once, see translate_backlog().
+ */
+static void *translator_thread(void *data)
+{
+   struct adapter *a = (struct adapter *)data;
+   struct ReportPipeline *pipeline = &a->pipeline;
+
+   while (!a->quitting)
+   {
+      uint32_t tail = pipeline->tail;
+      uint32_t head = __atomic_load_n(&pipeline->head, __ATOMIC_ACQUIRE);
+      if (tail == head)
+      {
+         __atomic_store_n(&pipeline->translator_sleeping, 1, __ATOMIC_SEQ_CST);
+         if (tail == __atomic_load_n(&pipeline->head, __ATOMIC_SEQ_CST) && !a->quitting)
+         {
+            struct pollfd pollfd = { .fd = pipeline->eventfd, .events = POLLIN };
+            poll(&pollfd, 1, -1);
+         }
+         __atomic_store_n(&pipeline->translator_sleeping, 0, __ATOMIC_SEQ_CST);
+
+         uint64_t count;
+         ssize_t ret = read(pipeline->eventfd, &count, sizeof(count));
+         (void)ret;
+         continue;
+      }
+
+      // the USB thread does not touch these slots before the tail moves on
+      uint32_t end = uses_catch_up ? head : tail + 1;
+      struct ReportSlot *latest = report_slot(pipeline, end - 1);
+      bool reports_controller = false;
+      for (uint32_t k = tail; k != end; k++)
+         reports_controller = reports_controller || reports_any_controller(report_slot(pipeline, k)->payload);
+
+      if (!has_any_port_connected(a) && !reports_controller)
+         count_metric(a->metrics.idle_reports, end - tail);
+      else
+      {
+         unsigned char rumble[5];
+         if (uses_catch_up)
+            translate_backlog(a, tail, end);
+         else
+            translate_adapter_report(a, latest->payload, &latest->arrival);
+
+         PROFILE_BEGIN(rumble);
+         evaluate_rumble(a, &latest->arrival, rumble);
+         PROFILE_END(a->profile, stage_rumble, rumble);
+
+         uint32_t rumble_request;
+         memcpy(&rumble_request, &rumble[1], sizeof(rumble_request));
+         __atomic_store_n(&pipeline->rumble_request, rumble_request, __ATOMIC_RELAXED);
+         __atomic_store_n(&pipeline->has_port_connected, has_any_port_connected(a), __ATOMIC_RELAXED);
+      }
+      __atomic_store_n(&pipeline->tail, end, __ATOMIC_RELEASE);
+   }
+
+   destroy_adapter_outputs(a);
+   return NULL;
+}
+
+static void *adapter_thread(void *data)
+{
+   struct adapter *a = (struct adapter *)data;
+   struct UsbRecovery recovery = { 0 };
+
+   __atomic_store_n(&a->last_report_ns, clock_ns(CLOCK_MONOTONIC), __ATOMIC_RELAXED);
+
+   while (!a->quitting)
+   {
+      int init_ret = adapter_send_init(a);
+      if (init_ret == LIBUSB_SUCCESS)
+         break;
+      if (!recover_from_transfer_error(a, &recovery, init_ret))
+         a->quitting = true;
+   }
+
+   if (uses_pipeline)
+      run_pipelined_adapter_loop(a, &recovery);
+   else
+      run_adapter_loop(a, &recovery);
+
+   return NULL;
+}
+
+/** "--handoff-socket": a new instance takes over the uinput devices of the running one, so games keep their controllers
+ *  across a restart or an upgrade. The new instance connects and sends HANDOFF_VERSION, the running one stops its adapters
+ *  without destroying their devices, releases the USB interfaces and sends one HandoffPort per connected port with the
+ *  uinput file descriptors attached (SCM_RIGHTS), then a record with port_index HANDOFF_END and exits.
+ *  The new instance claims the adapters and keeps writing into the same event devices.
+ */
+#define HANDOFF_VERSION 1
+#define HANDOFF_END 0xff
+
+struct HandoffPort {
+   uint32_t version;
+   uint32_t size;  // sizeof(struct HandoffPort), both instances must agree on the layout
+   uint8_t bus_number;
+   uint8_t device_address;
+   uint8_t port_index;
+   uint8_t type;
+   bool extra_power;
+   uint8_t personality_count;  // the file descriptors after the one of the main device
+   uint8_t personality_kinds[MAX_PERSONALITIES];
+   struct TranslationState translated;
+   struct TranslationState personality_translated[MAX_PERSONALITIES];
+   struct ff_event ff_events[MAX_FF_EVENTS];
+};
+
+static struct HandoffRecord {
+   struct HandoffPort port;
+   int fds[1 + MAX_PERSONALITIES];
+   bool claimed;
+} *handoff_records = NULL;
+static int handoff_record_count = 0;
+static int handoff_listen_fd = -1;
+static int handoff_peer_fd = -1;  // while handing over, see accept_handoff()
+static int handoff_request_fd = -1;  // a connected instance which has not sent its request yet
+static int64_t handoff_request_deadline_ns;
+
+static bool set_handoff_address(struct sockaddr_un *address)
+{
+   *address = (struct sockaddr_un){ .sun_family = AF_UNIX };
+   if (strlen(handoff_socket_path) >= sizeof(address->sun_path))
+   {
+      fprintf(stderr, "handoff socket path too long: %s\n", handoff_socket_path);
+      return false;
+   }
+   strcpy(address->sun_path, handoff_socket_path);
+   return true;
+}
+
+static void destroy_uinput_fd(int fd)
+{
+   ioctl(fd, UI_DEV_DESTROY);
+   close(fd);
+}
+
+// returns false if the peer is gone or sent something else than a HandoffPort with its file descriptors
+static bool receive_handoff_port(int fd, struct HandoffPort *port, int fds[1 + MAX_PERSONALITIES])
+{
+   char control[CMSG_SPACE(sizeof(int) * (1 + MAX_PERSONALITIES))];
+   struct iovec iov = { .iov_base = port, .iov_len = sizeof(*port) };
+   struct msghdr message = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+
+   ssize_t ret = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+   int fd_count = 0;
+   for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header != NULL; header = CMSG_NXTHDR(&message, header))
+   {
+      if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+      {
+         fd_count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+         memcpy(fds, CMSG_DATA(header), sizeof(int) * fd_count);
+      }
+   }
+
+   bool is_valid = ret == sizeof(*port) && port->version == HANDOFF_VERSION && port->size == sizeof(*port);
+   if (is_valid && port->port_index != HANDOFF_END)
+      is_valid = port->port_index < 4 && port->personality_count <= MAX_PERSONALITIES && fd_count == 1 + port->personality_count;
+   if (!is_valid)
+   {
+      for (int j = 0; j < fd_count; j++)
+         destroy_uinput_fd(fds[j]);
+   }
+   return is_valid;
+}
+
+// takes over the devices of the instance which listens on the handoff socket, if there is one
+static void receive_handoff()
+{
+   struct sockaddr_un address;
+   if (!set_handoff_address(&address))
+      return;
+
+   int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+   if (fd < 0)
+      return;
+   if (connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0)
+   {
+      close(fd);  // no running instance
+      return;
+   }
+
+   struct timeval timeout = { .tv_sec = 5, .tv_usec = 0 };
+   setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+   uint32_t request = HANDOFF_VERSION;
+   if (send(fd, &request, sizeof(request), MSG_NOSIGNAL) != sizeof(request))
+   {
+      close(fd);
+      return;
+   }
+
+   bool is_complete = false;
+   while (!is_complete)
+   {
+      struct HandoffRecord record = { .claimed = false };
+      if (!receive_handoff_port(fd, &record.port, record.fds))
+         break;
+      if (record.port.port_index == HANDOFF_END)
+      {
+         is_complete = true;
+         break;
+      }
+
+      struct HandoffRecord *records = realloc(handoff_records, sizeof(*records) * (handoff_record_count + 1));
+      if (records == NULL)
+      {
+         for (int j = 0; j <= record.port.personality_count; j++)
+            destroy_uinput_fd(record.fds[j]);
+         continue;
+      }
+      handoff_records = records;
+      handoff_records[handoff_record_count++] = record;
+   }
+   close(fd);
+
+   fprintf(stderr, "took over %d ports from the running instance%s\n", handoff_record_count, is_complete ? "" : " (incomplete handoff)");
+}
+
+/** Gives the ports of a newly opened adapter the devices which the previous instance handed over for it.
+ *  Personalities are matched by kind, the ones which are new get a device of their own, the ones which are gone are destroyed.
+ *  Options which change the codes of the main device only apply after the controller is plugged in again.
+ */
+static void adopt_handed_off_ports(struct adapter *a)
+{
+   // only uinput devices can be taken over, release_unclaimed_handoff() destroys the others and the ports connect anew
+   if (a->backend == usb_backend_simulated || output_backend != output_backend_uinput)
+      return;
+
+   for (int r = 0; r < handoff_record_count; r++)
+   {
+      struct HandoffRecord *record = &handoff_records[r];
+      if (record->claimed || record->port.bus_number != a->bus_number || record->port.device_address != a->device_address)
+         continue;
+      record->claimed = true;
+
+      int i = record->port.port_index;
+      struct ports *port = &a->controllers[i];
+      port->uinput = record->fds[0];
+      port->type = record->port.type;
+      port->extra_power = record->port.extra_power;
+      port->translated = record->port.translated;
+      memcpy(port->ff_events, record->port.ff_events, sizeof(port->ff_events));
+      port->connected = true;
+      port->is_adopted = true;
+      reset_output_rate(i, port);
+
+      bool is_taken[MAX_PERSONALITIES] = { false };
+      for (int p = 0; p < personality_count; p++)
+      {
+         struct PersonalityOutput *output = &port->personality_outputs[p];
+         int q = 0;
+         while (q < record->port.personality_count && (is_taken[q] || record->port.personality_kinds[q] != personality_kinds[p]))
+            q++;
+         if (q < record->port.personality_count)
+         {
+            is_taken[q] = true;
+            output->uinput = record->fds[1 + q];
+            output->translated = record->port.personality_translated[q];
+            continue;
+         }
+         output->uinput = uinput_open(i, &personalities[p].config, personalities[p].name, false);
+         memset(&output->translated, 0, sizeof(output->translated));
+         reset_thumbstick_filters(&output->translated);
+      }
+      for (int q = 0; q < record->port.personality_count; q++)
+         if (!is_taken[q])
+            destroy_uinput_fd(record->fds[1 + q]);
+
+      log_message("port %d of adapter %p taken over\n", i+1, a->device);
+   }
+}
+
+// destroys the devices of the adapters which were not found again, must run after the first device enumeration
+static void release_unclaimed_handoff()
+{
+   for (int r = 0; r < handoff_record_count; r++)
+   {
+      struct HandoffRecord *record = &handoff_records[r];
+      if (record->claimed)
+         continue;
+      for (int j = 0; j <= record->port.personality_count; j++)
+         destroy_uinput_fd(record->fds[j]);
+   }
+   free(handoff_records);
+   handoff_records = NULL;
+   handoff_record_count = 0;
+}
+
+static bool send_handoff_port(int fd, struct HandoffPort *port, int fds[], int fd_count)
+{
+   char control[CMSG_SPACE(sizeof(int) * (1 + MAX_PERSONALITIES))];
+   memset(control, 0, sizeof(control));
+   struct iovec iov = { .iov_base = port, .iov_len = sizeof(*port) };
+   struct msghdr message = { .msg_iov = &iov, .msg_iovlen = 1 };
+   if (fd_count > 0)
+   {
+      message.msg_control = control;
+      message.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+      struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+      header->cmsg_level = SOL_SOCKET;
+      header->cmsg_type = SCM_RIGHTS;
+      header->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+      memcpy(CMSG_DATA(header), fds, sizeof(int) * fd_count);
+   }
+   return sendmsg(fd, &message, MSG_NOSIGNAL) == sizeof(*port);
+}
+
+// called for every adapter whose threads stopped during a handoff, the devices only live on in the new instance
+static void hand_off_adapter_ports(struct adapter *a)
+{
+   for (int i = 0; i < 4; i++)
+   {
+      struct ports *port = &a->controllers[i];
+      if (!port->connected)
+         continue;
+
+      struct HandoffPort record = {
+         .version = HANDOFF_VERSION,
+         .size = sizeof(record),
+         .bus_number = a->bus_number,
+         .device_address = a->device_address,
+         .port_index = i,
+         .type = port->type,
+         .extra_power = port->extra_power,
+         .translated = port->translated,
+      };
+      memcpy(record.ff_events, port->ff_events, sizeof(record.ff_events));
+
+      int fds[1 + MAX_PERSONALITIES] = { port->uinput };
+      int fd_count = 1;
+      for (int p = 0; p < personality_count; p++)
+      {
+         struct PersonalityOutput *output = &port->personality_outputs[p];
+         if (output->uinput < 0)
+            continue;
+         record.personality_kinds[record.personality_count] = personality_kinds[p];
+         record.personality_translated[record.personality_count] = output->translated;
+         record.personality_count++;
+         fds[fd_count++] = output->uinput;
+      }
+
+      if (!send_handoff_port(handoff_peer_fd, &record, fds, fd_count))
+         log_message("handing over port %d failed: %s\n", i+1, strerror(errno));
+      for (int j = 0; j < fd_count; j++)
+         close(fds[j]);  // without UI_DEV_DESTROY, the new instance holds the devices now
+      port->connected = false;
+   }
+}
+
+static struct adapter *new_adapter(struct libusb_device *dev, enum UsbBackend backend)
+{
+   void *memory = NULL;
+   if (posix_memalign(&memory, CACHE_LINE_SIZE, sizeof(struct adapter)) != 0)
+   {
+      fprintf(stderr, "FATAL: posix_memalign() failed\n");
+      exit(-1);
+   }
+   struct adapter *a = memset(memory, 0, sizeof(struct adapter));
+   for (int i = 0; i < 4; i++)
+   {
+      reset_thumbstick_filters(&a->controllers[i].translated);
+      a->controllers[i].port_index = i;
+   }
+   a->device = dev;
+   if (dev != NULL)
+   {
+      a->bus_number = libusb_get_bus_number(dev);
+      a->device_address = libusb_get_device_address(dev);
+   }
+   a->backend = backend;
+   a->usbfs_fd = -1;
+   a->state_index = -1;
+   a->pipeline.eventfd = -1;
+   return a;
+}
+
+// numbers the opened adapter, links it into the adapter list and starts its thread
+static void start_adapter(struct adapter *a)
+{
+   // lowest number not taken by another adapter
+   for (struct adapter *other = adapters.next; other != NULL; )
+   {
+      if (other->id == a->id)
+      {
+         a->id++;
+         other = adapters.next;
+      }
+      else
+         other = other->next;
+   }
+   for (int i = 0; i < 4; i++)
+      a->controllers[i].adapter_id = a->id;
+
+   claim_state_slot(a);
+
+   struct adapter *old_head = adapters.next;
+   adapters.next = a;
+   a->next = old_head;
+
+   if (uses_pipeline)
+   {
+      a->pipeline.eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (a->pipeline.eventfd < 0)
+      {
+         perror("FATAL: cannot create eventfd for the translator thread");
+         exit(-1);
+      }
+      create_thread(&a->pipeline.thread, translator_thread, a);
+   }
+   create_thread(&a->thread, adapter_thread, a);
+
+   TRACE_PROBE(adapter_added, a->id, a->bus_number, a->device_address);
+   log_message("adapter %p connected\n", a->device);
+}
+
+// takes over the handed-off ports of the new adapter and starts it, frees it if it cannot be opened
+static void open_new_adapter(struct adapter *a)
+{
+   if (!adapter_open(a))
+   {
+      if (a->usbfs_fd >= 0)
+         close(a->usbfs_fd);
+      free(a);
+      return;
+   }
+
+   adopt_handed_off_ports(a);
+   start_adapter(a);
+}
+
+static void add_adapter(struct libusb_device *dev)
+{
+   open_new_adapter(new_adapter(dev, usb_backend));
+}
+
+// stops the adapter following *previous in the list, waits for its thread and frees it
+static void remove_next_adapter(struct adapter *previous)
+{
+   struct adapter *a = previous->next;
+   a->quitting = true;
+
+   adapter_release(a);
+
+   pthread_join(a->thread, NULL);
+   if (uses_pipeline)
+   {
+      // the USB thread woke the translator thread on its way out
+      pthread_join(a->pipeline.thread, NULL);
+      close(a->pipeline.eventfd);
+   }
+   if (a->keeps_outputs)
+      hand_off_adapter_ports(a);
+   TRACE_PROBE(adapter_removed, a->id);
+   log_message("adapter %p disconnected\n", a->device);
+   release_state_slot(a);
+   adapter_close(a);
+   previous->next = a->next;
+   free(a);
+}
+
+static void remove_adapter(struct libusb_device *dev)
+{
+   struct adapter *a = &adapters;
+   while (a->next != NULL)
+   {
+      if (a->next->device == dev)
+      {
+         remove_next_adapter(a);
+         return;
+      }
+
+      a = a->next;
+   }
+}
+
+// all threads stop in parallel, so the shutdown takes one transfer timeout instead of one per adapter
+static void remove_all_adapters()
+{
+   for (struct adapter *a = adapters.next; a != NULL; a = a->next)
+      a->quitting = true;
+
+   while (adapters.next)
+      remove_next_adapter(&adapters);
+}
+
+static bool open_handoff_socket()
+{
+   struct sockaddr_un address;
+   if (!set_handoff_address(&address))
+      return false;
+
+   handoff_listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+   if (handoff_listen_fd < 0)
+   {
+      perror("cannot create handoff socket");
+      return false;
+   }
+
+   unlink(handoff_socket_path);
+   // only the owner may connect, accept_handoff() also checks the peer's user
+   mode_t old_umask = umask(0077);
+   int bind_ret = bind(handoff_listen_fd, (struct sockaddr*)&address, sizeof(address));
+   umask(old_umask);
+   if (bind_ret != 0 || listen(handoff_listen_fd, 1) != 0)
+   {
+      fprintf(stderr, "cannot listen on %s: %s\n", handoff_socket_path, strerror(errno));
+      close(handoff_listen_fd);
+      handoff_listen_fd = -1;
+      return false;
+   }
+   return true;
+}
+
+// after a handoff, the path belongs to the new instance
+static void close_handoff_socket(bool has_handed_off)
+{
+   if (handoff_listen_fd < 0)
+      return;
+
+   if (handoff_request_fd >= 0)
+      close(handoff_request_fd);
+   handoff_request_fd = -1;
+
+   close(handoff_listen_fd);
+   handoff_listen_fd = -1;
+   if (!has_handed_off)
+      unlink(handoff_socket_path);
+}
+
+// the devices are only handed to an instance of the same user
+static bool is_handoff_peer_trusted(int peer)
+{
+   struct ucred credentials;
+   socklen_t length = sizeof(credentials);
+   if (getsockopt(peer, SOL_SOCKET, SO_PEERCRED, &credentials, &length) != 0)
+      return false;
+   return credentials.uid == geteuid();
+}
+
+/** Polled by the main loop. Hands all adapters over to a new instance which connected to the handoff socket,
+ *  returns true if this instance should exit now.
+ *  The request is read without blocking, a peer gets a second to send it before it is dropped.
+ */
+static bool accept_handoff()
+{
+   if (handoff_request_fd < 0)
+   {
+      int peer = accept4(handoff_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+      if (peer < 0)
+         return false;
+      if (!is_handoff_peer_trusted(peer))
+      {
+         log_message("ignoring a handoff request of another user\n");
+         close(peer);
+         return false;
+      }
+      handoff_request_fd = peer;
+      handoff_request_deadline_ns = clock_ns(CLOCK_MONOTONIC) + 1000000000LL;
+   }
+
+   int peer = handoff_request_fd;
+   uint32_t request = 0;
+   ssize_t ret = recv(peer, &request, sizeof(request), MSG_DONTWAIT);
+   if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && clock_ns(CLOCK_MONOTONIC) < handoff_request_deadline_ns)
+      return false;  // not sent yet, checked again on the next dispatch
+
+   handoff_request_fd = -1;
+   if (ret != sizeof(request) || request != HANDOFF_VERSION)
+   {
+      log_message(ret < 0 ? "ignoring a handoff peer which sent no request\n" : "ignoring a handoff request of another version\n");
+      close(peer);
+      return false;
+   }
+
+   log_message("handing the adapters over to a new instance\n");
+   for (struct adapter *a = adapters.next; a != NULL; a = a->next)
+      a->keeps_outputs = output_backend == output_backend_uinput;
+   handoff_peer_fd = peer;
+   remove_all_adapters();  // hands over the ports of each adapter as soon as its threads stopped
+
+   struct HandoffPort end = { .version = HANDOFF_VERSION, .size = sizeof(end), .port_index = HANDOFF_END };
+   send_handoff_port(peer, &end, NULL, 0);
+   handoff_peer_fd = -1;
+   close(peer);
+   return true;
+}
+
+static int LIBUSB_CALL hotplug_callback(struct libusb_context *ctx, struct libusb_device *dev, libusb_hotplug_event event, void *user_data)
+{
+   (void)ctx;
+   (void)user_data;
+   if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+   {
+      add_adapter(dev);
+   }
+   else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
+   {
+      remove_adapter(dev);
+   }
+
+   return 0;
+}
+
+static struct udev_monitor *usb_monitor = NULL;
+
+/** Fallback for libusb builds or containers without working hotplug support: watches the uevents of USB devices.
+ *  Without a running udevd (e.g. in containers), the kernel's uevents are received instead of udevd's.
+ */
+static bool open_usb_monitor(struct udev *udev)
+{
+   const char *source = access("/run/udev/control", F_OK) == 0 ? "udev" : "kernel";
+   usb_monitor = udev_monitor_new_from_netlink(udev, source);
+   if (usb_monitor == NULL)
+   {
+      fprintf(stderr, "cannot create a udev monitor, hotplugging not enabled\n");
+      return false;
+   }
+
+   if (udev_monitor_filter_add_match_subsystem_devtype(usb_monitor, "usb", "usb_device") < 0
+         || udev_monitor_enable_receiving(usb_monitor) < 0)
+   {
+      fprintf(stderr, "cannot receive %s uevents, hotplugging not enabled\n", source);
+      udev_monitor_unref(usb_monitor);
+      usb_monitor = NULL;
+      return false;
+   }
+   return true;
+}
+
+static void close_usb_monitor()
+{
+   if (usb_monitor == NULL)
+      return;
+
+   udev_monitor_unref(usb_monitor);
+   usb_monitor = NULL;
+}
+
+// the adapter list entry before the adapter at this USB address, NULL if there is none
+static struct adapter *find_previous_adapter(uint8_t bus_number, uint8_t device_address)
+{
+   for (struct adapter *previous = &adapters; previous->next != NULL; previous = previous->next)
+   {
+      if (previous->next->bus_number == bus_number && previous->next->device_address == device_address)
+         return previous;
+   }
+   return NULL;
+}
+
+/** Opens the device node of the uevent directly, libusb's device list is only updated by its own hotplug monitor,
+ *  which is the one not working when the uevents are watched.
+ */
+static void add_adapter_at(uint8_t bus_number, uint8_t device_address)
+{
+   if (usb_backend == usb_backend_usbfs)
+   {
+      // usbfs_open() opens the node
+      struct adapter *a = new_adapter(NULL, usb_backend);
+      a->bus_number = bus_number;
+      a->device_address = device_address;
+      open_new_adapter(a);
+      return;
+   }
+
+#if LIBUSB_API_VERSION >= 0x01000107
+   char path[32];
+   snprintf(path, sizeof(path), "/dev/bus/usb/%03d/%03d", bus_number, device_address);
+   int fd = open(path, O_RDWR | O_CLOEXEC);
+   if (fd < 0)
+   {
+      log_message("cannot open %s: %s\n", path, strerror(errno));
+      return;
+   }
+
+   struct libusb_device_handle *handle;
+   if (libusb_wrap_sys_device(NULL, (intptr_t)fd, &handle) != 0)
+   {
+      log_message("libusb cannot use %s\n", path);
+      close(fd);
+      return;
+   }
+
+   // the device of a wrapped handle has no bus number
+   struct adapter *a = new_adapter(libusb_get_device(handle), usb_backend);
+   a->handle = handle;
+   a->usbfs_fd = fd;
+   a->bus_number = bus_number;
+   a->device_address = device_address;
+   open_new_adapter(a);
+#else
+   // older libusb cannot wrap a node, its device list is the only way
+   struct libusb_device **devices;
+   int count = libusb_get_device_list(NULL, &devices);
+   bool is_found = false;
+
+   for (int i = 0; i < count && !is_found; i++)
+   {
+      if (libusb_get_bus_number(devices[i]) == bus_number && libusb_get_device_address(devices[i]) == device_address)
+      {
+         is_found = true;
+         add_adapter(devices[i]);
+      }
+   }
+
+   if (!is_found)
+      log_message("adapter %03d/%03d is not known to libusb, try --usbfs\n", bus_number, device_address);
+   if (count > 0)
+      libusb_free_device_list(devices, 1);
+#endif
+}
+
+// the uevent counterpart of hotplug_callback(), the kernel's PRODUCT, BUSNUM and DEVNUM variables are sent on add and remove
+static void handle_usb_uevent(struct udev_device *device)
+{
+   const char *action = udev_device_get_action(device);
+   const char *product = udev_device_get_property_value(device, "PRODUCT");
+   const char *bus_number = udev_device_get_property_value(device, "BUSNUM");
+   const char *device_address = udev_device_get_property_value(device, "DEVNUM");
+   unsigned int vendor_id, product_id;
+
+   if (action == NULL || product == NULL || bus_number == NULL || device_address == NULL
+         || sscanf(product, "%x/%x", &vendor_id, &product_id) != 2
+         || vendor_id != USB_NINTENDO_VENDOR || product_id != USB_ID_PRODUCT)
+      return;
+
+   uint8_t bus = (uint8_t)strtoul(bus_number, NULL, 10);
+   uint8_t address = (uint8_t)strtoul(device_address, NULL, 10);
+   struct adapter *previous = find_previous_adapter(bus, address);
+
+   // the monitor is opened before the enumeration at startup, which may have found an adapter whose add event was still queued
+   if (strcmp(action, "add") == 0 && previous == NULL)
+      add_adapter_at(bus, address);
+   else if (strcmp(action, "remove") == 0 && previous != NULL)
+      remove_next_adapter(previous);
+}
+
+static void receive_usb_uevents()
+{
+   struct udev_device *device;
+   while ((device = udev_monitor_receive_device(usb_monitor)) != NULL)
+   {
+      handle_usb_uevent(device);
+      udev_device_unref(device);
+   }
+}
+
+/** Replaces libusb_handle_events_timeout_completed() in the main loop while the udev monitor is used,
+ *  so that uevents are handled as soon as they arrive instead of on the next tick.
+ *  While an adapter thread handles the libusb events during its transfer, only the monitor is polled.
+ */
+static void handle_events_and_uevents(int timeout)
+{
+   struct timeval no_timeout = { .tv_sec = 0, .tv_usec = 0 };
+   bool handles_libusb_events = libusb_try_lock_events(NULL) == 0;
+
+   int libusb_count = 0;
+   const struct libusb_pollfd **libusb_pollfds = handles_libusb_events ? libusb_get_pollfds(NULL) : NULL;
+   while (libusb_pollfds != NULL && libusb_pollfds[libusb_count] != NULL)
+      libusb_count++;
+
+   struct pollfd pollfds[libusb_count + 1];
+   for (int i = 0; i < libusb_count; i++)
+      pollfds[i] = (struct pollfd){ .fd = libusb_pollfds[i]->fd, .events = libusb_pollfds[i]->events };
+   pollfds[libusb_count] = (struct pollfd){ .fd = udev_monitor_get_fd(usb_monitor), .events = POLLIN };
+#if LIBUSB_API_VERSION >= 0x01000104
+   libusb_free_pollfds(libusb_pollfds);
+#else
+   free(libusb_pollfds);
+#endif
+
+   struct timeval libusb_timeout;
+   if (handles_libusb_events && libusb_get_next_timeout(NULL, &libusb_timeout) == 1)
+   {
+      int libusb_timeout_ms = (int)(libusb_timeout.tv_sec * 1000 + (libusb_timeout.tv_usec + 999) / 1000);
+      if (libusb_timeout_ms < timeout)
+         timeout = libusb_timeout_ms;
+   }
+
+   int poll_ret = poll(pollfds, libusb_count + 1, timeout);
+
+   if (handles_libusb_events)
+   {
+      if (libusb_event_handling_ok(NULL))
+         libusb_handle_events_locked(NULL, &no_timeout);
+      libusb_unlock_events(NULL);
+   }
+
+   if (poll_ret > 0 && (pollfds[libusb_count].revents & POLLIN))
+      receive_usb_uevents();
+}
+
+static void write_metric_header(FILE *file, const char *name, const char *type, const char *help)
+{
+   fprintf(file, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static double thread_cpu_seconds(pthread_t thread)
+{
+   clockid_t clock;
+   if (pthread_getcpuclockid(thread, &clock) != 0)
+      return 0.0;
+   return clock_ns(clock) / 1e9;
+}
+
+#define for_each_adapter(a) for (struct adapter *a = adapters.next; a != NULL; a = a->next)
+#define for_each_port(a, port, j) for (int j = 0; j < 4; j++) for (struct ports *port = &a->controllers[j]; port != NULL; port = NULL)
+
+#define write_adapter_counter(file, name, help, member) do { \
+      write_metric_header(file, name, "counter", help); \
+      for_each_adapter(a) \
+         fprintf(file, name "{adapter=\"%d\"} %llu\n", a->id, (unsigned long long)read_metric(a->metrics.member)); \
+   } while (0)
+
+#define write_port_counter(file, name, help, member) do { \
+      write_metric_header(file, name, "counter", help); \
+      for_each_adapter(a) \
+         for_each_port(a, port, j) \
+            fprintf(file, name "{adapter=\"%d\",port=\"%d\"} %llu\n", a->id, j+1, (unsigned long long)read_metric(port->metrics.member)); \
+   } while (0)
+
+/** Rewrites the metrics file in the Prometheus text exposition format, e.g. for the textfile collector of the node exporter.
+ *  Runs on the main thread which also owns the adapter list, the counters are read without locks.
+ */
+static void write_metrics_file()
+{
+   char temporary_path[PATH_MAX];
+   snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", metrics_file_path);
+
+   FILE *file = fopen(temporary_path, "w");
+   if (file == NULL)
+   {
+      fprintf(stderr, "cannot write metrics to %s: %s\n", temporary_path, strerror(errno));
+      return;
+   }
+
+   write_adapter_counter(file, "wiiugc_packets_received_total", "Valid controller reports received from the adapter.", packets_received);
+   write_adapter_counter(file, "wiiugc_packets_dropped_total", "Transfers which did not contain a valid controller report.", packets_dropped);
+   write_adapter_counter(file, "wiiugc_idle_reports_total", "Valid reports which only had their status bytes checked because no controller was plugged in.", idle_reports);
+   write_adapter_counter(file, "wiiugc_rumble_transfers_total", "Rumble state transfers sent to the adapter.", rumble_transfers);
+   write_adapter_counter(file, "wiiugc_usb_in_timeouts_total", "Report transfers which timed out without data.", in_timeouts);
+   write_adapter_counter(file, "wiiugc_watchdog_expirations_total", "Times the adapter sent no report for a whole watchdog window.", watchdog_expirations);
+   write_adapter_counter(file, "wiiugc_usb_clear_halts_total", "Endpoint halts cleared to recover from USB errors.", clear_halts);
+   write_adapter_counter(file, "wiiugc_usb_resets_total", "Device resets to recover from USB errors.", resets);
+   write_adapter_counter(file, "wiiugc_usb_reinits_total", "Init commands sent again to recover from USB errors.", reinits);
+   if (uses_pipeline)
+   {
+      write_adapter_counter(file, "wiiugc_pipeline_overflows_total", "Reports dropped because the translator thread was a whole ring behind the USB thread.", pipeline_overflows);
+
+      write_metric_header(file, "wiiugc_pipeline_depth", "gauge", "Reports waiting for the translator thread.");
+      for_each_adapter(a)
+         fprintf(file, "wiiugc_pipeline_depth{adapter=\"%d\"} %u\n", a->id,
+            __atomic_load_n(&a->pipeline.head, __ATOMIC_RELAXED) - __atomic_load_n(&a->pipeline.tail, __ATOMIC_RELAXED));
+
+      write_metric_header(file, "wiiugc_pipeline_depth_max", "gauge", "Most reports which were waiting for the translator thread at once.");
+      for_each_adapter(a)
+         fprintf(file, "wiiugc_pipeline_depth_max{adapter=\"%d\"} %llu\n", a->id, (unsigned long long)read_metric(a->metrics.pipeline_depth_max));
+   }
+
+   write_metric_header(file, "wiiugc_usb_errors_total", "counter", "Failed USB transfers by libusb error code.");
+   for_each_adapter(a)
+      for (int j = 1; j < USB_ERROR_CODES; j++)
+         fprintf(file, "wiiugc_usb_errors_total{adapter=\"%d\",code=\"%s\"} %llu\n", a->id,
+            libusb_error_name(j == USB_ERROR_CODES - 1 ? LIBUSB_ERROR_OTHER : -j), (unsigned long long)read_metric(a->metrics.usb_errors[j]));
+
+   write_port_counter(file, "wiiugc_events_written_total", "Input events (uinput) or input reports (uhid) written.", events_written);
+   write_port_counter(file, "wiiugc_writes_total", "write() calls for input events or input reports.", writes);
+   write_port_counter(file, "wiiugc_jitter_events_saved_total", "Axis changes held back by the jitter filter.", jitter_events_saved);
+   write_port_counter(file, "wiiugc_jitter_writes_saved_total", "Reports which needed no write because the jitter filter held back all their changes.", jitter_writes_saved);
+   write_port_counter(file, "wiiugc_coalesced_reports_total", "Reports replaced by a later one before the output tick of --output-rate.", coalesced_reports);
+   if (uses_catch_up)
+      write_port_counter(file, "wiiugc_collapsed_reports_total", "Reports merged into a later report because the translator thread was behind.", collapsed_reports);
+   write_port_counter(file, "wiiugc_ff_uploads_total", "Force feedback effects uploaded.", ff_uploads);
+   write_port_counter(file, "wiiugc_ff_erases_total", "Force feedback effects erased.", ff_erases);
+   write_port_counter(file, "wiiugc_ff_plays_total", "Force feedback play and stop requests.", ff_plays);
+   write_port_counter(file, "wiiugc_connects_total", "Controllers plugged into the port.", connects);
+   write_port_counter(file, "wiiugc_disconnects_total", "Controllers unplugged from the port.", disconnects);
+
+   if (personality_count > 0)
+   {
+      write_metric_header(file, "wiiugc_personality_events_written_total", "counter", "Input events written to the devices of --personalities.");
+      for_each_adapter(a)
+         for_each_port(a, port, j)
+            for (int p = 0; p < personality_count; p++)
+               fprintf(file, "wiiugc_personality_events_written_total{adapter=\"%d\",port=\"%d\",personality=\"%s\"} %llu\n", a->id, j+1,
+                  personality_names[personality_kinds[p]], (unsigned long long)read_metric(port->personality_outputs[p].events_written));
+      write_metric_header(file, "wiiugc_personality_writes_total", "counter", "write() calls for the devices of --personalities.");
+      for_each_adapter(a)
+         for_each_port(a, port, j)
+            for (int p = 0; p < personality_count; p++)
+               fprintf(file, "wiiugc_personality_writes_total{adapter=\"%d\",port=\"%d\",personality=\"%s\"} %llu\n", a->id, j+1,
+                  personality_names[personality_kinds[p]], (unsigned long long)read_metric(port->personality_outputs[p].writes));
+   }
+
+   write_metric_header(file, "wiiugc_port_connected", "gauge", "1 if a controller is plugged into the port.");
+   for_each_adapter(a)
+      for_each_port(a, port, j)
+         fprintf(file, "wiiugc_port_connected{adapter=\"%d\",port=\"%d\"} %d\n", a->id, j+1, (int)port->connected);
+
+   write_metric_header(file, "wiiugc_last_report_age_seconds", "gauge", "Time since the adapter sent its last valid report.");
+   int64_t now_ns = clock_ns(CLOCK_MONOTONIC);
+   for_each_adapter(a)
+      fprintf(file, "wiiugc_last_report_age_seconds{adapter=\"%d\"} %.3f\n", a->id, (now_ns - __atomic_load_n(&a->last_report_ns, __ATOMIC_RELAXED)) / 1e9);
+
+   write_metric_header(file, "wiiugc_thread_cpu_seconds_total", "counter", "CPU time used per thread.");
+   fprintf(file, "wiiugc_thread_cpu_seconds_total{thread=\"main\"} %.6f\n", clock_ns(CLOCK_THREAD_CPUTIME_ID) / 1e9);
+   for_each_adapter(a)
+      fprintf(file, "wiiugc_thread_cpu_seconds_total{thread=\"adapter\",adapter=\"%d\"} %.6f\n", a->id, thread_cpu_seconds(a->thread));
+   for_each_adapter(a)
+      if (uses_pipeline)
+         fprintf(file, "wiiugc_thread_cpu_seconds_total{thread=\"translator\",adapter=\"%d\"} %.6f\n", a->id, thread_cpu_seconds(a->pipeline.thread));
+   if (stream_listen_fd >= 0)
+      fprintf(file, "wiiugc_thread_cpu_seconds_total{thread=\"subscribers\"} %.6f\n", thread_cpu_seconds(stream_thread));
+
+   if (stream_listen_fd >= 0)
+   {
+      write_metric_header(file, "wiiugc_stream_frames_total", "counter", "Subscriber stream frames by outcome.");
+      fprintf(file, "wiiugc_stream_frames_total{outcome=\"published\"} %llu\n", (unsigned long long)read_metric(stream_stats.frames_published));
+      fprintf(file, "wiiugc_stream_frames_total{outcome=\"overwritten\"} %llu\n", (unsigned long long)read_metric(stream_stats.frames_overwritten));
+      fprintf(file, "wiiugc_stream_frames_total{outcome=\"skipped\"} %llu\n", (unsigned long long)read_metric(stream_stats.frames_skipped));
+      write_metric_header(file, "wiiugc_stream_subscribers_dropped_total", "counter", "Subscribers dropped for being too slow.");
+      fprintf(file, "wiiugc_stream_subscribers_dropped_total %llu\n", (unsigned long long)read_metric(stream_stats.subscribers_dropped));
+   }
+
+   if (fclose(file) != 0 || rename(temporary_path, metrics_file_path) != 0)
+   {
+      fprintf(stderr, "cannot write metrics to %s: %s\n", metrics_file_path, strerror(errno));
+      unlink(temporary_path);
+   }
+}
+
+struct LatencySamples {
+   int64_t *values;
+   size_t count;
+   size_t capacity;
+};
+
+static void add_latency_sample(struct LatencySamples *samples, int64_t value)
+{
+   if (samples->count == samples->capacity)
+   {
+      size_t capacity = samples->capacity ? 2 * samples->capacity : 4096;
+      int64_t *values = realloc(samples->values, capacity * sizeof(values[0]));
+      if (values == NULL)
+         return; // a benchmark with fewer samples is still a benchmark
+      samples->values = values;
+      samples->capacity = capacity;
+   }
+   samples->values[samples->count++] = value;
+}
+
+static int compare_int64(const void *first, const void *second)
+{
+   int64_t a = *(const int64_t*)first, b = *(const int64_t*)second;
+   return (a > b) - (a < b);
+}
+
+static void sort_latency_samples(struct LatencySamples *samples)
+{
+   qsort(samples->values, samples->count, sizeof(samples->values[0]), compare_int64);
+}
+
+// expects sorted samples
+static int64_t latency_percentile(const struct LatencySamples *samples, int percent)
+{
+   if (samples->count == 0)
+      return 0;
+   size_t index = (samples->count - 1) * percent / 100;
+   return samples->values[index];
+}
+
+static void free_latency_samples(struct LatencySamples *samples)
+{
+   free(samples->values);
+   *samples = (struct LatencySamples){ 0 };
+}
+
+struct UsbBenchmarkResult {
+   int reports;
+   int errors;
+   int64_t wall_ns;
+   int64_t cpu_ns;
+   struct LatencySamples call_latencies;
+};
+
+static bool benchmark_usb_backend(struct libusb_device *device, enum UsbBackend backend, struct UsbBenchmarkResult *result)
+{
+   struct adapter a = { .device = device, .backend = backend, .usbfs_fd = -1, .state_index = -1 };
+   if (!adapter_open(&a))
+      return false;
+
+   if (adapter_send_init(&a) != LIBUSB_SUCCESS)
+   {
+      adapter_release(&a);
+      adapter_close(&a);
+      return false;
+   }
+
+   int64_t start_ns = clock_ns(CLOCK_MONOTONIC);
+   int64_t end_ns = start_ns + benchmark_seconds * 1000000000LL;
+   int64_t cpu_start_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+   int64_t now_ns = start_ns;
+
+   while (now_ns < end_ns && !quitting)
+   {
+      unsigned char payload[37];
+      int size = 0;
+      int transfer_ret = adapter_transfer(&a, EP_IN, payload, sizeof(payload), &size, 1000);
+      int64_t done_ns = clock_ns(CLOCK_MONOTONIC);
+
+      if (transfer_ret != 0)
+         result->errors++;
+      else if (size == 37 && payload[0] == 0x21)
+      {
+         result->reports++;
+         add_latency_sample(&result->call_latencies, done_ns - now_ns);
+      }
+      now_ns = done_ns;
+   }
+
+   result->cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start_ns;
+   result->wall_ns = now_ns - start_ns;
+
+   adapter_release(&a);
+   adapter_close(&a);
+   return true;
+}
+
+/** Reads reports from the same adapter through each USB backend in turn and prints the CPU cost per report and
+ *  the time spent per transfer call. Both backends wait for the adapter's 1 ms polling interval, so the CPU columns show the per-packet overhead.
+ */
+static int run_usb_benchmark(struct libusb_device *device)
+{
+   static const char *backend_names[] = { [usb_backend_libusb] = "libusb", [usb_backend_usbfs] = "usbfs" };
+   struct UsbBenchmarkResult results[2] = { 0 };
+   bool succeeded[2] = { false, false };
+
+   for (int backend = usb_backend_libusb; backend <= usb_backend_usbfs; backend++)
+   {
+      fprintf(stderr, "benchmarking %s backend for %d seconds\n", backend_names[backend], benchmark_seconds);
+      succeeded[backend] = benchmark_usb_backend(device, backend, &results[backend]);
+   }
+
+   fprintf(stdout, "%-8s %9s %7s %12s %7s %9s %9s %9s %9s\n", "backend", "reports", "errors", "cpu/report", "cpu", "call p50", "call p90", "call p99", "call max");
+   for (int backend = usb_backend_libusb; backend <= usb_backend_usbfs; backend++)
+   {
+      struct UsbBenchmarkResult *result = &results[backend];
+      if (!succeeded[backend])
+      {
+         fprintf(stdout, "%-8s (failed to open the adapter)\n", backend_names[backend]);
+         continue;
+      }
+      sort_latency_samples(&result->call_latencies);
+      double cpu_per_report_us = result->reports ? result->cpu_ns / 1000.0 / result->reports : 0.0;
+      double cpu_percent = result->wall_ns ? 100.0 * result->cpu_ns / result->wall_ns : 0.0;
+      fprintf(stdout, "%-8s %9d %7d %10.2fus %6.2f%% %7.1fus %7.1fus %7.1fus %7.1fus\n",
+         backend_names[backend], result->reports, result->errors, cpu_per_report_us, cpu_percent,
+         latency_percentile(&result->call_latencies, 50) / 1000.0,
+         latency_percentile(&result->call_latencies, 90) / 1000.0,
+         latency_percentile(&result->call_latencies, 99) / 1000.0,
+         latency_percentile(&result->call_latencies, 100) / 1000.0);
+      free_latency_samples(&result->call_latencies);
+   }
+
+   return (succeeded[usb_backend_libusb] && succeeded[usb_backend_usbfs]) ? 0 : 1;
+}
+
+#ifdef PROFILE_STAGES
+static double profile_ns_per_tick = 1.0;
+static volatile int profile_requested;
+
+static void calibrate_profile_clock()
+{
+#if defined(__x86_64__) || defined(__i386__)
+   int64_t start_ns = clock_ns(CLOCK_MONOTONIC);
+   uint64_t start_ticks = profile_now();
+   struct timespec wait = { .tv_sec = 0, .tv_nsec = 20000000 };
+   nanosleep(&wait, NULL);
+   profile_ns_per_tick = (double)(clock_ns(CLOCK_MONOTONIC) - start_ns) / (double)(profile_now() - start_ticks);
+#endif
+}
+
+static void print_profile_row(FILE *file, const char *label, const struct StageProfile *profile, uint64_t reports)
+{
+   if (reports == 0)
+      return;
+
+   fprintf(file, "%-18s %10llu", label, (unsigned long long)reports);
+   uint64_t total_ticks = 0;
+   for (int stage = 0; stage < stage_count; stage++)
+   {
+      uint64_t ticks = read_metric(profile->ticks[stage]);
+      total_ticks += ticks;
+      if (read_metric(profile->calls[stage]) == 0)
+         fprintf(file, " %9s", "-");
+      else
+         fprintf(file, " %7.0fns", ticks * profile_ns_per_tick / reports);
+   }
+   fprintf(file, " %7.0fns\n", total_ticks * profile_ns_per_tick / reports);
+}
+
+/** Prints the average time per report which each stage took, per adapter for the USB stages and per port for the others. */
+static void print_stage_profile(FILE *file)
+{
+   static const char *stage_names[stage_count] = {
+      [stage_usb_reap] = "usb reap", [stage_status] = "status", [stage_buttons] = "buttons", [stage_axes] = "axes",
+      [stage_dpad] = "dpad", [stage_write] = "write", [stage_ff] = "ff", [stage_rumble] = "rumble",
+   };
+
+   fprintf(file, "%-18s %10s", "time per report", "reports");
+   for (int stage = 0; stage < stage_count; stage++)
+      fprintf(file, " %9s", stage_names[stage]);
+   fprintf(file, " %9s\n", "total");
+
+   for_each_adapter(a)
+   {
+      char label[32];
+      snprintf(label, sizeof(label), "adapter %d", a->id);
+      print_profile_row(file, label, &a->profile, read_metric(a->profile.calls[stage_usb_reap]));
+      for_each_port(a, port, j)
+      {
+         snprintf(label, sizeof(label), "adapter %d port %d", a->id, j+1);
+         print_profile_row(file, label, &port->profile, read_metric(port->profile.calls[stage_status]));
+      }
+   }
+}
+#endif
+
+// waits for benchmark_seconds or until SIGINT
+static void benchmark_sleep()
+{
+   struct timespec duration = { .tv_sec = benchmark_seconds, .tv_nsec = 0 };
+   while (!quitting && nanosleep(&duration, &duration) != 0 && errno == EINTR)
+      continue;
+}
+
+// an adapter which stopped sending reports, every read waits for the whole timeout
+static int stalled_read_report(struct SimulatedDevice *device, unsigned char *payload, int length, int *transferred, unsigned int timeout)
+{
+   (void)device;
+   (void)payload;
+   (void)length;
+   unsigned int wait_ms = timeout ? timeout : 1000;  // a real transfer without timeout would never return
+   struct timespec wait = { .tv_sec = wait_ms / 1000, .tv_nsec = (wait_ms % 1000) * 1000000L };
+   nanosleep(&wait, NULL);
+   *transferred = 0;
+   return LIBUSB_ERROR_TIMEOUT;
+}
+
+static int accepting_write_command(struct SimulatedDevice *device, unsigned char *data, int length, int *transferred, unsigned int timeout)
+{
+   (void)device;
+   (void)data;
+   (void)timeout;
+   *transferred = length;
+   return LIBUSB_SUCCESS;
+}
+
+/** Starts adapters whose reports have stalled, lets the watchdog run and measures how long removing them takes.
+ *  Fails if the shutdown takes longer than one transfer timeout plus a margin.
+ */
+static int run_shutdown_benchmark()
+{
+   static struct SimulatedDevice stalled_device = { stalled_read_report, accepting_write_command };
+
+   fprintf(stderr, "running %d stalled adapters for %d seconds\n", benchmark_adapters, benchmark_seconds);
+   for (int i = 0; i < benchmark_adapters; i++)
+   {
+      struct adapter *a = new_adapter(NULL, usb_backend_simulated);
+      a->simulation = &stalled_device;
+      start_adapter(a);
+   }
+
+   benchmark_sleep();
+
+   uint64_t expirations = 0, timeouts = 0;
+   for_each_adapter(a)
+   {
+      expirations += read_metric(a->metrics.watchdog_expirations);
+      timeouts += read_metric(a->metrics.in_timeouts);
+   }
+
+   int64_t start_ns = clock_ns(CLOCK_MONOTONIC);
+   remove_all_adapters();
+   int64_t shutdown_ns = clock_ns(CLOCK_MONOTONIC) - start_ns;
+
+   int64_t bound_ns = ((usb_timeout > 100 ? usb_timeout : 100) + 100) * 1000000LL;
+   bool passed = usb_timeout != 0 && shutdown_ns <= bound_ns;
+   fprintf(stdout, "%-10s %12s %12s %12s %12s\n", "adapters", "in timeouts", "watchdog", "shutdown", "bound");
+   fprintf(stdout, "%-10d %12llu %12llu %10.1fms %10.1fms %s\n", benchmark_adapters, (unsigned long long)timeouts,
+      (unsigned long long)expirations, shutdown_ns / 1e6, bound_ns / 1e6, passed ? "ok" : "TOO SLOW");
+   return passed ? 0 : 1;
+}
+
+// an adapter which sends a new report every interval, or on every read without interval.
+// When controllers are plugged in, all four are wired and move their sticks and press buttons.
+struct SyntheticAdapter {
+   struct SimulatedDevice device;
+   uint32_t frame;
+   bool has_controllers;  // changed by the benchmark while the adapter runs
+   int64_t interval_ns;
+   int64_t next_report_ns;
+};
+
+static void fill_synthetic_report(unsigned char *payload, uint32_t frame, bool has_controllers)
+{
+   memset(payload, 0, 37);
+   payload[0] = 0x21;
+   for (int i = 0; i < 4 && has_controllers; i++)
+   {
+      unsigned char *controller = &payload[1 + 9*i];
+      controller[0] = STATE_NORMAL;
+      controller[1] = (unsigned char)(frame >> 6);  // buttons change every 64 reports
+      controller[2] = (unsigned char)(frame >> 8) & 0x0f;
+      for (int j = 0; j < AXIS_COUNT; j++)
+      {
+         unsigned char phase = (unsigned char)(frame + 40*j + 16*i);
+         controller[3 + j] = phase < 128 ? 2 * phase : 2 * (255 - phase);  // triangle wave
+      }
+   }
+}
+
+static int synthetic_read_report(struct SimulatedDevice *device, unsigned char *payload, int length, int *transferred, unsigned int timeout)
+{
+   (void)timeout;
+   struct SyntheticAdapter *synthetic = (struct SyntheticAdapter *)device;
+   if (length < 37)
+      return LIBUSB_ERROR_OVERFLOW;
+
+   if (synthetic->interval_ns > 0)
+   {
+      // like the interrupt endpoint, a read waits for the next interval unless it is overdue already
+      int64_t now_ns = clock_ns(CLOCK_MONOTONIC);
+      if (synthetic->next_report_ns > now_ns)
       {
-         if (e.code < MAX_FF_EVENTS && port->ff_events[e.code].in_use)
-         {
-            port->ff_events[e.code].repetitions = e.value;
-            update_ff_start_stop(&port->ff_events[e.code], current_time);
-         }
+         struct timespec wakeup = { .tv_sec = synthetic->next_report_ns / 1000000000, .tv_nsec = synthetic->next_report_ns % 1000000000 };
+         clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeup, NULL);
+         now_ns = synthetic->next_report_ns;
       }
+      synthetic->next_report_ns = now_ns + synthetic->interval_ns;
    }
+
+   fill_synthetic_report(payload, synthetic->frame++, __atomic_load_n(&synthetic->has_controllers, __ATOMIC_RELAXED));
+   *transferred = 37;
+   return LIBUSB_SUCCESS;
 }
 
-static void *adapter_thread(void *data)
+static struct SyntheticAdapter *new_synthetic_adapter(int64_t interval_ns, bool has_controllers)
 {
-   struct adapter *a = (struct adapter *)data;
+   void *memory = NULL;
+   size_t size = (sizeof(struct SyntheticAdapter) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+   if (posix_memalign(&memory, CACHE_LINE_SIZE, size) != 0)
+   {
+      fprintf(stderr, "FATAL: posix_memalign() failed\n");
+      exit(-1);
+   }
+   struct SyntheticAdapter *synthetic = memory;
+   synthetic->device.read_report = synthetic_read_report;
+   synthetic->device.write_command = accepting_write_command;
+   synthetic->frame = 0;
+   synthetic->has_controllers = has_controllers;
+   synthetic->interval_ns = interval_ns;
+   synthetic->next_report_ns = 0;
+   return synthetic;
+}
 
-    int bytes_transferred;
-    unsigned char payload[1] = { 0x13 };
-
-    int transfer_ret = libusb_interrupt_transfer(a->handle, EP_OUT, payload, sizeof(payload), &bytes_transferred, 0);
-
-    if (transfer_ret != 0) {
-        fprintf(stderr, "libusb_interrupt_transfer: %s\n", libusb_error_name(transfer_ret));
-        return NULL;
-    }
-    if (bytes_transferred != sizeof(payload)) {
-        fprintf(stderr, "libusb_interrupt_transfer %d/%d bytes transferred.\n", bytes_transferred, sizeof(payload));
-        return NULL;
-    }
-
-   #define decide_on_quitting_the_loop() do { \
-         if (quits_on_interrupt) { \
-            a->quitting = true; \
-            break; \
-         } \
-   \
-         sleep(1); \
-   } while(0)
+// 1, 2, 4 … and finally benchmark_adapters, 0 after the last one
+static int next_benchmark_count(int count)
+{
+   if (count >= benchmark_adapters)
+      return 0;
+   return count * 2 < benchmark_adapters ? count * 2 : benchmark_adapters;
+}
 
-   while (!a->quitting)
+/** Runs 1, 2, 4 … up to benchmark_adapters busy adapters at once into the null output and prints reports per second and CPU time per report.
+ *  Adapters share no written cache lines, so the CPU time per report stays flat as long as every adapter thread has a core of its own.
+ */
+static int run_adapters_benchmark()
+{
+   output_backend = output_backend_null;
+   long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+   fprintf(stdout, "%-9s %14s %14s %12s %9s\n", "adapters", "reports/s", "per adapter", "cpu/report", "scaling");
+   double single_adapter_rate = 0.0;
+   for (int count = 1; count != 0 && !quitting; count = next_benchmark_count(count))
    {
-      unsigned char payload[37];
-      int size = 0;
-      int transfer_ret = libusb_interrupt_transfer(a->handle, EP_IN, payload, sizeof(payload), &size, 0);
-      if (transfer_ret != 0) {
-         fprintf(stderr, "libusb_interrupt_transfer error %d\n", transfer_ret);
-         decide_on_quitting_the_loop();
-         continue;
+      struct SyntheticAdapter *synthetics[count];
+      for (int i = 0; i < count; i++)
+      {
+         synthetics[i] = new_synthetic_adapter(0, true);
+         struct adapter *a = new_adapter(NULL, usb_backend_simulated);
+         a->simulation = &synthetics[i]->device;
+         start_adapter(a);
       }
-      if (size != 37 || payload[0] != 0x21)
-         continue;
 
-      unsigned char *controller = &payload[1];
+      benchmark_sleep();
 
-      unsigned char rumble[5] = { 0x11, 0, 0, 0, 0 };
-      struct timespec current_time = { 0 };
-      clock_gettime(CLOCK_MONOTONIC_RAW, &current_time);
-      for (int i = 0; i < 4; i++, controller += 9)
+      uint64_t reports = 0;
+      double cpu_seconds = 0.0;
+      for_each_adapter(a)
       {
-         handle_payload(i, &a->controllers[i], controller, &current_time);
-         rumble[i+1] = 0;
-         if (a->controllers[i].extra_power && a->controllers[i].type == STATE_NORMAL)
-         {
-            for (int j = 0; j < MAX_FF_EVENTS; j++)
-            {
-               struct ff_event *e = &a->controllers[i].ff_events[j];
-               if (e->in_use)
-               {
-                  bool after_start = ts_lessthan(&e->start_time, &current_time);
-                  bool before_end = ts_greaterthan(&e->end_time, &current_time);
+         reports += read_metric(a->metrics.packets_received);
+         cpu_seconds += thread_cpu_seconds(a->thread);
+      }
+      remove_all_adapters();
+      for (int i = 0; i < count; i++)
+         free(synthetics[i]);
+
+      double rate = (double)reports / benchmark_seconds;
+      double rate_per_adapter = rate / count;
+      if (count == 1)
+         single_adapter_rate = rate_per_adapter;
+      fprintf(stdout, "%-9d %14.0f %14.0f %10.3fus %8.1f%%%s\n", count, rate, rate_per_adapter,
+         reports ? cpu_seconds * 1e6 / reports : 0.0, single_adapter_rate > 0.0 ? 100.0 * rate_per_adapter / single_adapter_rate : 0.0,
+         count > cores ? " (more adapters than cores)" : "");
+   }
+   return 0;
+}
 
-                  if (after_start && before_end)
-                     rumble[i+1] = 1;
-                  else if (after_start && !before_end)
-                     update_ff_start_stop(e, &current_time);
-               }
-            }
-         }
+/** Runs one adapter at the real adapter's 1000 reports per second, first with all ports empty, then with four controllers,
+ *  and prints the CPU use of its thread in both states.
+ */
+static int run_idle_benchmark()
+{
+   static const char *state_names[] = { "idle", "active" };
+   output_backend = output_backend_null;
+
+   struct SyntheticAdapter *synthetic = new_synthetic_adapter(1000000, false);
+   struct adapter *a = new_adapter(NULL, usb_backend_simulated);
+   a->simulation = &synthetic->device;
+   start_adapter(a);
+
+   fprintf(stderr, "idle interval %d ms\n", idle_interval);
+   fprintf(stdout, "%-7s %10s %8s %12s\n", "state", "reports/s", "cpu", "cpu/report");
+   for (int state = 0; state < 2 && !quitting; state++)
+   {
+      __atomic_store_n(&synthetic->has_controllers, state == 1, __ATOMIC_RELAXED);
+
+      uint64_t reports_before = read_metric(a->metrics.packets_received);
+      double cpu_before = thread_cpu_seconds(a->thread);
+      int64_t start_ns = clock_ns(CLOCK_MONOTONIC);
+      benchmark_sleep();
+      double wall_seconds = (clock_ns(CLOCK_MONOTONIC) - start_ns) / 1e9;
+      uint64_t reports = read_metric(a->metrics.packets_received) - reports_before;
+      double cpu_seconds = thread_cpu_seconds(a->thread) - cpu_before;
+
+      fprintf(stdout, "%-7s %10.0f %7.3f%% %10.3fus\n", state_names[state], reports / wall_seconds,
+         100.0 * cpu_seconds / wall_seconds, reports ? cpu_seconds * 1e6 / reports : 0.0);
+   }
+
+   remove_all_adapters();
+   free(synthetic);
+   return 0;
+}
+
+// an adapter with random input at a fixed report rate: sticks wander, buttons are mashed, controllers are plugged in and out
+struct LoadAdapter {
+   struct SimulatedDevice device;
+   uint32_t random_state;
+   uint32_t churn_period;  // reports per expected plug or unplug of a port
+   int64_t interval_ns;
+   int64_t next_report_ns;
+   int64_t pending_arrival_ns;  // when the report which is being handled arrived, 0 before the first one
+   uint64_t missed_reports;
+   unsigned char controllers[4][9];
+   struct LatencySamples latencies;  // arrival of a report until the adapter thread asks for the next one
+};
+
+static uint32_t next_random(uint32_t *state)
+{
+   // xorshift32
+   uint32_t x = *state;
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+   *state = x;
+   return x;
+}
+
+static void update_load_controllers(struct LoadAdapter *load)
+{
+   static const int button_bits[] = { 0, 1, 2, 3, 8, 9, 10, 11, 12, 13, 14, 15 };
+
+   for (int i = 0; i < 4; i++)
+   {
+      unsigned char *controller = load->controllers[i];
+      uint32_t random = next_random(&load->random_state);
+      if (random % load->churn_period == 0)
+         controller[0] ^= STATE_NORMAL;
+      if (!(controller[0] & STATE_NORMAL))
+         continue;
+
+      if ((random >> 24) < 32)  // one report in eight toggles a button
+      {
+         int bit = button_bits[(random >> 8) % 12];
+         if (bit >= 8)
+            controller[1] ^= 1 << (bit - 8);
+         else
+            controller[2] ^= 1 << bit;
       }
 
-      if (memcmp(rumble, a->rumble, sizeof(rumble)) != 0)
+      uint32_t steps = next_random(&load->random_state);
+      for (int j = 0; j < AXIS_COUNT; j++)
       {
-         memcpy(a->rumble, rumble, sizeof(rumble));
-         transfer_ret = libusb_interrupt_transfer(a->handle, EP_OUT, a->rumble, sizeof(a->rumble), &size, 0);
-         if (transfer_ret != 0) {
-            fprintf(stderr, "libusb_interrupt_transfer error %d\n", transfer_ret);
-            decide_on_quitting_the_loop();
-            continue;
-         }
+         int value = controller[3 + j] + 2 * ((int)((steps >> (5*j)) & 7) - 3);
+         controller[3 + j] = value < 0 ? 0 : value > 255 ? 255 : value;
       }
    }
+}
 
-   for (int i = 0; i < 4; i++)
+static int load_read_report(struct SimulatedDevice *device, unsigned char *payload, int length, int *transferred, unsigned int timeout)
+{
+   (void)timeout;
+   struct LoadAdapter *load = (struct LoadAdapter *)device;
+   if (length < 37)
+      return LIBUSB_ERROR_OVERFLOW;
+
+   int64_t now_ns = clock_ns(CLOCK_MONOTONIC);
+   if (load->pending_arrival_ns != 0)
+      add_latency_sample(&load->latencies, now_ns - load->pending_arrival_ns);
+   if (load->next_report_ns == 0)
+      load->next_report_ns = now_ns;
+
+   if (load->next_report_ns > now_ns)
    {
-      if (a->controllers[i].connected)
-         uinput_destroy(i, &a->controllers[i]);
+      // the wake-up delay of the simulation is no latency of the driver, the report arrives when the read returns
+      struct timespec wakeup = { .tv_sec = load->next_report_ns / 1000000000, .tv_nsec = load->next_report_ns % 1000000000 };
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeup, NULL);
+      load->pending_arrival_ns = clock_ns(CLOCK_MONOTONIC);
+   }
+   else
+   {
+      // the thread is late, the report has been waiting since its interval began.
+      // Like the real endpoint, only the latest report is there, older ones are lost
+      int64_t missed = (now_ns - load->next_report_ns) / load->interval_ns;
+      load->missed_reports += missed;
+      load->next_report_ns += missed * load->interval_ns;
+      load->pending_arrival_ns = load->next_report_ns;
    }
+   load->next_report_ns += load->interval_ns;
 
-   return NULL;
+   update_load_controllers(load);
+   payload[0] = 0x21;
+   memcpy(&payload[1], load->controllers, sizeof(load->controllers));
+   *transferred = 37;
+   return LIBUSB_SUCCESS;
 }
 
-static void add_adapter(struct libusb_device *dev)
+static struct LoadAdapter *new_load_adapter(int index)
 {
-   struct adapter *a = calloc(1, sizeof(struct adapter));
-   if (a == NULL)
+   void *memory = NULL;
+   size_t size = (sizeof(struct LoadAdapter) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+   if (posix_memalign(&memory, CACHE_LINE_SIZE, size) != 0)
    {
-      fprintf(stderr, "FATAL: calloc() failed\n");
+      fprintf(stderr, "FATAL: posix_memalign() failed\n");
       exit(-1);
    }
-   a->device = dev;
-
-   if (libusb_open(a->device, &a->handle) != 0)
+   memset(memory, 0, size);
+   struct LoadAdapter *load = memory;
+   load->device.read_report = load_read_report;
+   load->device.write_command = accepting_write_command;
+   load->random_state = 2463534242u + 7919u * index;
+   load->churn_period = 2 * benchmark_rate;  // every port is plugged or unplugged about every 2 seconds
+   load->interval_ns = 1000000000LL / benchmark_rate;
+   for (int i = 0; i < 4; i++)
    {
-      fprintf(stderr, "Error opening device %p\n", a->device);
-      return;
+      load->controllers[i][0] = STATE_NORMAL;
+      memset(&load->controllers[i][3], 128, 4);
    }
+   return load;
+}
 
-   if (libusb_kernel_driver_active(a->handle, 0) == 1) {
-       fprintf(stderr, "Detaching kernel driver\n");
-       if (libusb_detach_kernel_driver(a->handle, 0)) {
-           fprintf(stderr, "Error detaching handle %p from kernel\n", a->handle);
-           return;
-       }
-   }
+/** Runs 1, 2, 4 … up to benchmark_adapters adapters with random input at benchmark_rate reports per second into the chosen output.
+ *  Prints the throughput, the reports lost because an adapter thread fell behind, the CPU use per adapter thread and
+ *  the latency percentiles from the arrival of a report until all its ports are handled, which bounds the latency of every single port.
+ */
+static int run_load_benchmark()
+{
+   if (!benchmark_uses_uinput)
+      output_backend = output_backend_null;
+   long cores = sysconf(_SC_NPROCESSORS_ONLN);
 
-   // thanks to https://github.com/dperelman/wii-u-gc-adapter
-   if (uses_explicit_libusb_claim)
+   fprintf(stderr, "%d reports per second per adapter into %s\n", benchmark_rate, benchmark_uses_uinput ? "uinput" : "the null output");
+   fprintf(stdout, "%-9s %12s %8s %12s %9s %9s %9s %9s\n", "adapters", "reports/s", "missed", "cpu/adapter", "p50", "p90", "p99", "max");
+   for (int count = 1; count != 0 && !quitting; count = next_benchmark_count(count))
    {
-      int tries_count = 0;
-      while(libusb_claim_interface(a->handle, 0) != 0)
+      struct LoadAdapter *loads[count];
+      for (int i = 0; i < count; i++)
       {
-         fprintf(stderr, "Error claiming interface 0 on adapter %#x from kernel, retry in 3 seconds\n", a->handle);
-         sleep(3);
-         fprintf(stderr, "\x1b[A(%d) ", ++tries_count); // thanks to https://stackoverflow.com/a/25103053
+         loads[i] = new_load_adapter(i);
+         struct adapter *a = new_adapter(NULL, usb_backend_simulated);
+         a->simulation = &loads[i]->device;
+         start_adapter(a);
       }
-   }
 
-   struct adapter *old_head = adapters.next;
-   adapters.next = a;
-   a->next = old_head;
+      int64_t start_ns = clock_ns(CLOCK_MONOTONIC);
+      benchmark_sleep();
+      double wall_seconds = (clock_ns(CLOCK_MONOTONIC) - start_ns) / 1e9;
 
-   pthread_create(&a->thread, NULL, adapter_thread, a);
+      uint64_t reports = 0;
+      double cpu_seconds = 0.0;
+      for_each_adapter(a)
+      {
+         reports += read_metric(a->metrics.packets_received);
+         cpu_seconds += thread_cpu_seconds(a->thread);
+         if (uses_pipeline)
+            cpu_seconds += thread_cpu_seconds(a->pipeline.thread);
+      }
+#ifdef PROFILE_STAGES
+      print_stage_profile(stdout);
+#endif
+      remove_all_adapters();
 
-   fprintf(stderr, "adapter %p connected\n", a->device);
+      struct LatencySamples latencies = { 0 };
+      uint64_t missed = 0;
+      for (int i = 0; i < count; i++)
+      {
+         for (size_t j = 0; j < loads[i]->latencies.count; j++)
+            add_latency_sample(&latencies, loads[i]->latencies.values[j]);
+         missed += loads[i]->missed_reports;
+         free_latency_samples(&loads[i]->latencies);
+         free(loads[i]);
+      }
+      sort_latency_samples(&latencies);
+
+      fprintf(stdout, "%-9d %12.0f %7.2f%% %11.2f%% %7.1fus %7.1fus %7.1fus %7.1fus%s\n", count, reports / wall_seconds,
+         reports + missed ? 100.0 * missed / (reports + missed) : 0.0, 100.0 * cpu_seconds / wall_seconds / count,
+         latency_percentile(&latencies, 50) / 1000.0, latency_percentile(&latencies, 90) / 1000.0,
+         latency_percentile(&latencies, 99) / 1000.0, latency_percentile(&latencies, 100) / 1000.0,
+         count > cores ? " (more adapters than cores)" : "");
+      free_latency_samples(&latencies);
+   }
+   return 0;
 }
 
-static void remove_adapter(struct libusb_device *dev)
+// the event node of the uinput device behind fd, e.g. /dev/input/event7, found in the sysfs directory named by UI_GET_SYSNAME
+static bool find_event_node(int uinput_fd, char *path, size_t size)
 {
-   struct adapter *a = &adapters;
-   while (a->next != NULL)
+   char sysname[64];
+   if (ioctl(uinput_fd, UI_GET_SYSNAME(sizeof(sysname)), sysname) < 0)
    {
-      if (a->next->device == dev)
+      fprintf(stderr, "UI_GET_SYSNAME failed: %s\n", strerror(errno));
+      return false;
+   }
+
+   char directory_path[PATH_MAX];
+   snprintf(directory_path, sizeof(directory_path), "/sys/devices/virtual/input/%s", sysname);
+   DIR *directory = opendir(directory_path);
+   if (directory == NULL)
+   {
+      fprintf(stderr, "cannot open %s: %s\n", directory_path, strerror(errno));
+      return false;
+   }
+
+   bool is_found = false;
+   struct dirent *entry;
+   while (!is_found && (entry = readdir(directory)) != NULL)
+   {
+      if (strncmp(entry->d_name, "event", 5) == 0)
       {
-         a->next->quitting = true;
-
-         if (uses_explicit_libusb_claim)
-            libusb_release_interface(a->next->handle, 0);
-         
-         pthread_join(a->next->thread, NULL);
-         fprintf(stderr, "adapter %p disconnected\n", a->next->device);
-         libusb_close(a->next->handle);
-         struct adapter *new_next = a->next->next;
-         free(a->next);
-         a->next = new_next;
-         return;
+         snprintf(path, size, "/dev/input/%s", entry->d_name);
+         is_found = true;
       }
+   }
+   closedir(directory);
+   if (!is_found)
+      fprintf(stderr, "%s has no event node\n", directory_path);
+   return is_found;
+}
 
-      a = a->next;
+// waits until the simulated controller on port 1 got its uinput device and opens the event node of that device
+static int open_benchmark_event_node(struct ports *port, char *path, size_t size)
+{
+   struct timespec millisecond = { .tv_sec = 0, .tv_nsec = 1000000 };
+   for (int tries = 0; tries < 1000 && !quitting; tries++)
+   {
+      int uinput_fd = __atomic_load_n(&port->connected, __ATOMIC_ACQUIRE) ? __atomic_load_n(&port->uinput, __ATOMIC_RELAXED) : -1;
+      if (uinput_fd >= 0)
+      {
+         if (!find_event_node(uinput_fd, path, size))
+            return -1;
+
+         // udev may still be creating the node
+         for (; tries < 1000 && !quitting; tries++)
+         {
+            int fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (fd >= 0 || errno != ENOENT)
+            {
+               if (fd < 0)
+                  fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+               return fd;
+            }
+            nanosleep(&millisecond, NULL);
+         }
+         break;
+      }
+      nanosleep(&millisecond, NULL);
    }
+   fprintf(stderr, "the simulated controller got no event node within a second\n");
+   return -1;
 }
 
-static int LIBUSB_CALL hotplug_callback(struct libusb_context *ctx, struct libusb_device *dev, libusb_hotplug_event event, void *user_data)
+/** Sends a simulated adapter with one wandering controller at benchmark_rate reports per second through the chosen options
+ *  into a real uinput device and reads its event node like a game. Every frame carries the arrival time of its report
+ *  (MSC_TIMESTAMP), so the latency covers the translation, the write, the kernel's evdev layer and the wake-up of the reader.
+ *  The spacing is taken from the event times of consecutive frames. Fails if the kernel dropped events (SYN_DROPPED).
+ */
+static int run_evdev_benchmark()
 {
-   (void)ctx;
-   (void)user_data;
-   if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+   output_backend = output_backend_uinput;
+   uses_msc_timestamp = true;
+   if (uinput_path == NULL)
    {
-      add_adapter(dev);
+      fprintf(stderr, "the evdev benchmark needs uinput\n");
+      return 1;
    }
-   else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
+
+   struct LoadAdapter *load = new_load_adapter(0);
+   load->churn_period = UINT32_MAX;  // the controller stays plugged in
+   for (int i = 1; i < 4; i++)
+      load->controllers[i][0] = 0;
+   struct adapter *a = new_adapter(NULL, usb_backend_simulated);
+   a->simulation = &load->device;
+   start_adapter(a);
+
+   char path[PATH_MAX];
+   int fd = open_benchmark_event_node(&a->controllers[0], path, sizeof(path));
+   if (fd < 0)
    {
-      remove_adapter(dev);
+      remove_all_adapters();
+      free_latency_samples(&load->latencies);
+      free(load);
+      return 1;
    }
+   clockid_t event_clock = CLOCK_MONOTONIC;
+   ioctl(fd, EVIOCSCLOCKID, &event_clock);
+   fprintf(stderr, "%d reports per second through %s for %d seconds\n", benchmark_rate, path, benchmark_seconds);
+
+   struct LatencySamples latencies = { 0 };
+   struct LatencySamples spacings = { 0 };
+   uint64_t frames = 0;
+   uint64_t drops = 0;
+   bool is_dropping = false;  // after SYN_DROPPED, the events until the next SYN_REPORT are incomplete
+   bool has_timestamp = false;
+   uint32_t frame_timestamp = 0;
+   int64_t last_frame_ns = 0;
+   int64_t start_ns = clock_ns(CLOCK_MONOTONIC);
+   int64_t end_ns = start_ns + benchmark_seconds * 1000000000LL;
+
+   struct input_event events[64];
+   for (int64_t now_ns = start_ns; now_ns < end_ns && !quitting; now_ns = clock_ns(CLOCK_MONOTONIC))
+   {
+      struct pollfd pollfd = { .fd = fd, .events = POLLIN };
+      if (poll(&pollfd, 1, (int)((end_ns - now_ns) / 1000000) + 1) <= 0)
+         continue;
+      ssize_t size = read(fd, events, sizeof(events));
+      struct timespec readable;
+      clock_gettime(CLOCK_MONOTONIC_RAW, &readable);
+      uint32_t readable_us = (uint32_t)(ts_to_ns(&readable) / 1000);
 
-   return 0;
+      for (int i = 0; size > 0 && i < size / (ssize_t)sizeof(events[0]); i++)
+      {
+         struct input_event *e = &events[i];
+         if (e->type == EV_SYN && e->code == SYN_DROPPED)
+         {
+            drops++;
+            is_dropping = true;
+            has_timestamp = false;
+         }
+         else if (e->type == EV_MSC && e->code == MSC_TIMESTAMP)
+         {
+            frame_timestamp = (uint32_t)e->value;
+            has_timestamp = true;
+         }
+         else if (e->type == EV_SYN && e->code == SYN_REPORT)
+         {
+            int64_t frame_ns = (int64_t)e->time.tv_sec * 1000000000 + (int64_t)e->time.tv_usec * 1000;
+            if (is_dropping)
+               is_dropping = false;
+            else
+            {
+               frames++;
+               if (has_timestamp)
+                  add_latency_sample(&latencies, (int64_t)(int32_t)(readable_us - frame_timestamp) * 1000);  // wraps like the timestamp
+               if (last_frame_ns != 0)
+                  add_latency_sample(&spacings, frame_ns - last_frame_ns);
+            }
+            last_frame_ns = frame_ns;
+            has_timestamp = false;
+         }
+      }
+   }
+   double wall_seconds = (clock_ns(CLOCK_MONOTONIC) - start_ns) / 1e9;
+
+   uint64_t reports = read_metric(a->metrics.packets_received);
+   close(fd);
+   remove_all_adapters();
+   free_latency_samples(&load->latencies);
+   free(load);
+
+   sort_latency_samples(&latencies);
+   sort_latency_samples(&spacings);
+   fprintf(stdout, "%-8s %9s %9s %9s %9s %9s\n", "", "min", "p50", "p90", "p99", "max");
+   struct LatencySamples *rows[] = { &latencies, &spacings };
+   const char *row_names[] = { "latency", "spacing" };
+   for (int r = 0; r < 2; r++)
+      fprintf(stdout, "%-8s %7.1fus %7.1fus %7.1fus %7.1fus %7.1fus\n", row_names[r],
+         latency_percentile(rows[r], 0) / 1000.0, latency_percentile(rows[r], 50) / 1000.0, latency_percentile(rows[r], 90) / 1000.0,
+         latency_percentile(rows[r], 99) / 1000.0, latency_percentile(rows[r], 100) / 1000.0);
+   fprintf(stdout, "%llu reports, %llu frames (%.0f/s), %llu SYN_DROPPED\n", (unsigned long long)reports,
+      (unsigned long long)frames, frames / wall_seconds, (unsigned long long)drops);
+
+   bool has_failed = frames == 0 || drops > 0;
+   free_latency_samples(&latencies);
+   free_latency_samples(&spacings);
+   return has_failed ? 1 : 0;
 }
 
-static void quitting_signal(int sig)
+#ifdef PROFILE_STAGES
+static void profile_signal(int sig)
 {
    (void)sig;
-   quitting = 1;
+   profile_requested = 1;
 }
+#endif
 
-static uint16_t parse_id(const char* str)
+static bool parse_id(const char* str, uint16_t *id)
 {
    char* endptr = NULL;
    unsigned long out = strtoul(str, &endptr, 0);
@@ -1469,10 +5569,11 @@ static uint16_t parse_id(const char* str)
    if (out > 0xffff || *endptr)
    {
       fprintf(stderr, "Invalid ID \"%s\"\n", str);
-      exit(1);
+      return false;
    }
 
-   return out;
+   *id = out;
+   return true;
 }
 
 enum {
@@ -1524,6 +5625,31 @@ enum {
    opt_binary_trigger,
    opt_analog_trigger,
    opt_no_trigger,
+   opt_libusb,
+   opt_usbfs,
+   opt_benchmark,
+   opt_benchmark_seconds,
+   opt_state_file,
+   opt_subscribe_socket,
+   opt_uinput,
+   opt_uhid,
+   opt_msc_timestamp,
+   opt_metrics_file,
+   opt_metrics_interval,
+   opt_usb_timeout,
+   opt_watchdog,
+   opt_benchmark_adapters,
+   opt_idle_interval,
+   opt_benchmark_rate,
+   opt_benchmark_sink,
+   opt_jitter_filter,
+   opt_pipelined,
+   opt_catch_up,
+   opt_output_rate,
+   opt_personalities,
+   opt_handoff_socket,
+   opt_udev_monitor,
+   opt_no_devices,
 };
 
 static struct option options[] = {
@@ -1577,10 +5703,35 @@ static struct option options[] = {
    { "trigger-buttons", no_argument, 0, opt_binary_trigger },
    { "trigger-axes", no_argument, 0, opt_analog_trigger },
    { "trigger-none", no_argument, 0, opt_no_trigger },
+   { "libusb", no_argument, 0, opt_libusb },
+   { "usbfs", no_argument, 0, opt_usbfs },
+   { "benchmark", required_argument, 0, opt_benchmark },
+   { "benchmark-seconds", required_argument, 0, opt_benchmark_seconds },
+   { "state-file", required_argument, 0, opt_state_file },
+   { "subscribe-socket", required_argument, 0, opt_subscribe_socket },
+   { "uinput", no_argument, 0, opt_uinput },
+   { "uhid", no_argument, 0, opt_uhid },
+   { "msc-timestamp", no_argument, 0, opt_msc_timestamp },
+   { "metrics-file", required_argument, 0, opt_metrics_file },
+   { "metrics-interval", required_argument, 0, opt_metrics_interval },
+   { "usb-timeout", required_argument, 0, opt_usb_timeout },
+   { "watchdog", required_argument, 0, opt_watchdog },
+   { "benchmark-adapters", required_argument, 0, opt_benchmark_adapters },
+   { "idle-interval", required_argument, 0, opt_idle_interval },
+   { "benchmark-rate", required_argument, 0, opt_benchmark_rate },
+   { "benchmark-sink", required_argument, 0, opt_benchmark_sink },
+   { "jitter-filter", required_argument, 0, opt_jitter_filter },
+   { "pipelined", no_argument, 0, opt_pipelined },
+   { "catch-up", no_argument, 0, opt_catch_up },
+   { "output-rate", required_argument, 0, opt_output_rate },
+   { "personalities", required_argument, 0, opt_personalities },
+   { "handoff-socket", required_argument, 0, opt_handoff_socket },
+   { "udev-monitor", no_argument, 0, opt_udev_monitor },
+   { "no-devices", no_argument, 0, opt_no_devices },
    { 0, 0, 0, 0 },
 };
 
-void swap_z_button_with_dpad_button(int z_code)
+static void swap_z_button_with_dpad_button(int z_code)
 {
    int remapped_button_count = sizeof(REMAPPED_DPAD_DEFAULTS) / sizeof(REMAPPED_DPAD_DEFAULTS[0]);
    int first_remapped_index = sizeof(button_code_values) / sizeof(button_code_values[0]) - remapped_button_count;
@@ -1595,7 +5746,7 @@ void swap_z_button_with_dpad_button(int z_code)
    }
 }
 
-void process_options()
+static void process_options()
 {
    if (vendor_id == 0)
       vendor_id = device_data[controller_index].vendor_id;
@@ -1607,6 +5758,19 @@ void process_options()
    fprintf(stderr, "vendor_id = %#06x\n", vendor_id);
    fprintf(stderr, "product_id = %#06x\n", product_id);
 
+   if (uses_raw_mode)
+   {
+      // fixed codes, none of the mapping options apply
+      memcpy(button_code_values, RAW_BUTTON_VALUES, sizeof(button_code_values));
+      for (int j = 0; j < AXIS_COUNT; j++)
+         axis_code_values[j] = (struct AxisCode){ -1, RAW_AXIS_VALUES[j] };
+      uses_thumbstick_left = uses_thumbstick_right = thumbstick_normal;
+      uses_trigger_left = uses_trigger_right = trigger_normal;
+      uses_shoulder_button = shoulder_button_none;
+      set_raw_absinfo();
+      return;
+   }
+
    if (uses_foreign_buttons)
       memcpy(button_code_values, BUTTON_XBOX_VALUES, sizeof(button_code_values));
    else
@@ -1699,16 +5863,23 @@ void process_options()
    }
 }
 
-int main(int argc, char *argv[])
+// the driver state between gc_open() and gc_close()
+static struct udev *udev;
+static struct udev_device *uinput;
+static struct libusb_device **benchmark_devices;
+static int benchmark_device_count;
+static libusb_hotplug_callback_handle hotplug_handle;
+static int hotplug_capability;
+static int64_t next_metrics_ns = 0;
+static bool has_handed_off = false;
+
+int gc_open(int argc, char *argv[])
 {
-   struct udev *udev;
-   struct udev_device *uinput;
-   struct sigaction sa;
    uinput_dev = default_udev_settings;
    init_AxisTransform();
 
-   memset(&sa, 0, sizeof(sa));
-
+   // the host program may have run getopt on its own arguments, 0 also resets glibc's internal state
+   optind = 0;
    while (1) {
       int option_index = 0;
       int c = getopt_long(argc, argv, "rh", options, &option_index);
@@ -1727,11 +5898,13 @@ int main(int argc, char *argv[])
             "\n");
          fprintf(stdout,
             "--help, -h                 Display this help text.\n"
-            "--raw                      (for testing) removes the adjustment of the input value range on analog input values, i.e. it sets min = 0, max = 255 instead of using the controller adjusted default range.\n"
+            "--raw                      passes the reports through as they arrive: axes ABS_X, ABS_Y, ABS_RX, ABS_RY, ABS_Z, ABS_RZ with the raw bytes 0…255, the 12 buttons with fixed codes (Z → BTN_Z).\n"
+            "                           No flip, range adjustment or mapping option applies. The cheapest mode, for emulators which calibrate on their own.\n"
             "--flip-y-axis              (default) reverses the received Y-axis value (for left thumbstick Y and right thumbstick Y) so that 0 produces 255 and 255 produces 0.\n"
             "                           Requires another Y axis inversion when used with xboxdrv. When an analog input is split into two axes, it flips each axis individually.\n"
             "--unflip-y-axis            leaves the Y axis signal value as it arrives (for ABS_Y and ABS_RY). Use this for games which expect genuine GameCube controller values.\n"
-            "--continue-on-interrupt    (default) it tries to wait and retry when libusb interrupt occurs (for example when entering sleep).\n"
+            "--continue-on-interrupt    (default) recovers from USB errors (for example when entering sleep) with retries after an exponential backoff (250 µs up to 1 s).\n"
+            "                           Persistent errors escalate to clearing the endpoint halt, a device reset and sending the adapter init again. Controllers stay connected meanwhile.\n"
             "--quit-on-interrupt        will make the thread stop and exit when a libusb interrupt occurs. Mutually exclusive to \"--quit-on-interrupt\".\n"
             "--vendor and --product     correspond to the IDs associated to the event device that should be read. Default values are vendor = %#06x, product = %#06x.\n"
             "--device-name              allows users to provide a custom device name that replaces the \"Wii U Adapter…\" one.\n"
@@ -1744,6 +5917,64 @@ int main(int argc, char *argv[])
             "\n",
             USB_NINTENDO_VENDOR, USB_ID_PRODUCT
          );
+         fprintf(stdout,
+            "--libusb                   (default) transfers the USB reports with libusb.\n"
+            "--usbfs                    transfers the USB reports by submitting and reaping URBs on the adapter's /dev/bus/usb node directly, which saves libusb's per-transfer overhead.\n"
+            "                           Detaches the kernel driver and claims the interface in one step (USBDEVFS_DISCONNECT_CLAIM), \"--claim\" has no effect.\n"
+            "--benchmark                runs a benchmark instead of the driver and prints its results. values: \"usb\" → compares CPU time per report and transfer call latency of libusb and usbfs\n"
+            "                           on the first connected adapter.\n"
+            "--benchmark-seconds        duration of each benchmark run, default is 5.\n"
+            "--state-file               publishes the raw state of every port (buttons, axes, connection type, extra power, arrival time) into a memory mapped file, e.g. in /dev/shm.\n"
+            "                           Readers map it and poll it without syscalls, see wii-u-gc-state.h for the layout and the lock-free reader function.\n"
+            "--subscribe-socket         listens on a UNIX socket (SOCK_SEQPACKET) and pushes connect, disconnect and state change frames of all ports to every connected subscriber.\n"
+            "                           Subscribers which cannot keep up skip frames (visible as sequence gaps) and are dropped eventually, see wii-u-gc-state.h for the frame layout.\n"
+            "--handoff-socket           restarts without taking the controllers away from running games. A new instance started with the same path takes over the uinput devices\n"
+            "                           of the running one, which then exits. Options which change the codes of a device apply after its controller is plugged in again.\n"
+            "--udev-monitor             finds plugged and unplugged adapters with a udev monitor instead of libusb's hotplug support, e.g. in containers where libusb is not notified.\n"
+            "                           Used automatically when libusb cannot register a hotplug callback. Without a running udevd, the kernel's uevents are watched directly.\n");
+         fprintf(stdout,
+            "--uinput                   (default) creates an input event device per controller with uinput, all mapping options apply.\n"
+            "--uhid                     creates a HID gamepad per controller with /dev/uhid instead (12 buttons, X, Y, Rx, Ry, Z, Rz as 0…255), for software reading HID devices (e.g. SDL's HIDAPI).\n"
+            "                           Only the y axis flip applies from the mapping options. A non-zero output report starts the rumble, a zero output report stops it.\n"
+            "--no-devices               creates no device per controller, for programs which link libwiiugc and read the ports through its API (see wii-u-gc.h).\n"
+            "--msc-timestamp            adds an EV_MSC/MSC_TIMESTAMP event before every SYN_REPORT which carries the arrival time of the USB report in microseconds (CLOCK_MONOTONIC_RAW, wrapping).\n"
+            "                           Event timestamps only show the time of writing, this lets input lag compensation see how old a sample is.\n"
+            "--metrics-file             rewrites the file atomically with counters of every adapter and port in the Prometheus text format (packets, USB errors, events, force feedback, CPU time …).\n"
+            "                           Point the textfile collector of the node exporter to its directory, the file name must end with \".prom\" then.\n"
+            "--metrics-interval         seconds between two updates of the metrics file, default is 5.\n"
+            "--jitter-filter            holds back changes of an analog input up to this many counts, so that a resting stick which dithers by 1 or 2 emits no events.\n"
+            "                           One value for all inputs or assignments like \"LX=2,LY=2,L=1\". \"auto\" learns the threshold from the noise while the input rests (up to 4).\n"
+            "--output-rate              input event frames per second and port, e.g. 250 or \"1=60,2=500\", default is 0 (every report). For games which fall behind a 1 kHz event stream.\n"
+            "                           Reports between two ticks only update the state, each tick writes the newest axes and every button press and release since the last tick.\n"
+            "--personalities            additional input devices per port, each with a fixed mapping of the same controller, e.g. \"xbox,wheel\". values: \"xbox\" → XBOX button names,\n"
+            "                           \"literal\" → BTN_A, BTN_B, BTN_X, BTN_Y, \"wheel\" → like \"--brake-gas-wheel\". They are named like the main device plus \"(xbox)\" etc. and have no rumble.\n"
+            "                           uinput only, the main device keeps the mapping of all other options.\n"
+            "\n");
+         fprintf(stdout,
+            "--usb-timeout              milliseconds after which a USB transfer gives up, default is 100. An adapter thread notices a shutdown or a removal within this time.\n"
+            "                           0 waits forever like before, then an adapter which stopped sending blocks the shutdown.\n"
+            "--watchdog                 milliseconds without a valid report after which the adapter counts as stuck, default is 2000, 0 turns it off.\n"
+            "                           Every expiry takes the next recovery step: clearing the endpoint halt, a device reset, sending the adapter init again.\n"
+            "--benchmark shutdown       starts stalled simulated adapters, lets the watchdog run and checks that removing them takes no longer than one transfer timeout.\n"
+            "--benchmark adapters       runs 1, 2, 4 … simulated adapters which send reports as fast as possible into a null output and prints the CPU time per report.\n"
+            "                           The cost per report should stay flat with more adapters as long as there are enough CPU cores.\n"
+            "--benchmark idle           runs a simulated adapter at 1000 reports per second, first without and then with controllers, and prints the CPU use in both states.\n"
+            "--benchmark load           runs 1, 2, 4 … simulated adapters with random stick motion, button mashing and controllers plugged in and out.\n"
+            "                           Prints reports per second, lost reports, CPU per adapter thread and latency percentiles from the arrival of a report until it is handled.\n"
+            "                           With \"--pipelined\" the CPU covers both threads and the latency ends when the USB thread has handed the report over.\n"
+            "--benchmark evdev          runs a simulated adapter with one controller into a real uinput device and reads its /dev/input/event node like a game.\n"
+            "                           Prints percentiles of the latency from the arrival of a report until its frame is readable and of the spacing between frames,\n"
+            "                           and counts SYN_DROPPED. Use a long \"--benchmark-seconds\" to catch rare drops. Fails if any frame was dropped.\n"
+            "--benchmark-rate           reports per second of each simulated adapter in the load and evdev benchmarks, 125 to 8000, default is 1000.\n"
+            "--benchmark-sink           output of the load benchmark. values: \"null\" (default) → translates only, \"uinput\" → creates real input devices\n"
+            "--benchmark-adapters       number of simulated adapters for the benchmarks, default is 8.\n"
+            "--idle-interval            milliseconds to wait between two reads while no controller is plugged into an adapter, default is 0 (read every report).\n"
+            "                           Saves CPU on always-on machines, a controller is recognized up to this much later.\n"
+            "--pipelined                reads each adapter in its own USB thread which only timestamps the reports and hands them to a translator thread.\n"
+            "                           A slow uinput or uhid write then never delays the next USB read, the metrics file shows the depth and overflows of the hand-over ring.\n"
+            "--catch-up                 implies \"--pipelined\". When reports pile up (overclocked adapters, a stalled CPU), the translator thread merges them:\n"
+            "                           every button press and release is kept, the axes jump to their latest values and each port gets one write and one SYN_REPORT.\n"
+            "\n");
          fprintf(stdout,
             "--z-to-thumbl              (default) activates a left thumbstick click (BTN_THUMBL) when pressing the Z button.\n"
             "                           This is useful for most PC games as they use BTN_THUMBL more often with gameplay relevance but almost never know BTN_Z.\n"
@@ -1807,19 +6038,21 @@ int main(int argc, char *argv[])
             "       \"Min Value\" is the lowest analog value emitted from an analog axis.\n"
             "       \"Max Value\" is the maximum analog value emitted from an analog axis. If this is too high, then the maximum input value (required by some games) cannot be reached.\n"
          );
-         exit(0);
+         return GC_OPEN_HELP;
       }
 
       switch (c) {
       case 'r':
          fprintf(stderr, "raw mode enabled\n");
-         set_raw_absinfo();
+         uses_raw_mode = true;
          break;
       case opt_vendor:
-         vendor_id = parse_id(optarg);
+         if (!parse_id(optarg, &vendor_id))
+            return -1;
          break;
       case opt_product:
-         product_id = parse_id(optarg);
+         if (!parse_id(optarg, &product_id))
+            return -1;
          break;
       case opt_device_name:
          if (device_name != NULL)
@@ -1840,6 +6073,66 @@ int main(int argc, char *argv[])
       case opt_quit_interrupt: quits_on_interrupt = true; break;
       case opt_claim: uses_explicit_libusb_claim = true; break;
       case opt_implicit_use: uses_explicit_libusb_claim = false; break;
+      case opt_libusb: usb_backend = usb_backend_libusb; break;
+      case opt_usbfs: usb_backend = usb_backend_usbfs; break;
+      case opt_benchmark:
+         if (strcmp(optarg, "usb") == 0)
+            benchmark_mode = benchmark_usb;
+         else if (strcmp(optarg, "shutdown") == 0)
+            benchmark_mode = benchmark_shutdown;
+         else if (strcmp(optarg, "adapters") == 0)
+            benchmark_mode = benchmark_adapters_scaling;
+         else if (strcmp(optarg, "idle") == 0)
+            benchmark_mode = benchmark_idle;
+         else if (strcmp(optarg, "load") == 0)
+            benchmark_mode = benchmark_load;
+         else if (strcmp(optarg, "evdev") == 0)
+            benchmark_mode = benchmark_evdev;
+         else
+         {
+            fprintf(stderr, "argument error: unknown benchmark \"%s\"\n", optarg);
+            return -1;
+         }
+         break;
+      case opt_benchmark_seconds: benchmark_seconds = (int)strtoul(optarg, NULL, 0); break;
+      case opt_state_file: state_file_path = optarg; break;
+      case opt_subscribe_socket: stream_socket_path = optarg; break;
+      case opt_uinput: output_backend = output_backend_uinput; break;
+      case opt_uhid: output_backend = output_backend_uhid; break;
+      case opt_no_devices: output_backend = output_backend_none; break;
+      case opt_msc_timestamp: uses_msc_timestamp = true; break;
+      case opt_metrics_file: metrics_file_path = optarg; break;
+      case opt_metrics_interval: metrics_interval = (int)strtoul(optarg, NULL, 0); break;
+      case opt_usb_timeout: usb_timeout = (unsigned int)strtoul(optarg, NULL, 0); break;
+      case opt_watchdog: watchdog_window = (int)strtoul(optarg, NULL, 0); break;
+      case opt_benchmark_adapters: benchmark_adapters = (int)strtoul(optarg, NULL, 0); break;
+      case opt_idle_interval: idle_interval = (int)strtoul(optarg, NULL, 0); break;
+      case opt_jitter_filter: set_jitter_filter(optarg); break;
+      case opt_pipelined: uses_pipeline = true; break;
+      case opt_catch_up: uses_pipeline = true; uses_catch_up = true; break;
+      case opt_output_rate: set_output_rate(optarg); break;
+      case opt_personalities: set_personalities(optarg); break;
+      case opt_handoff_socket: handoff_socket_path = optarg; break;
+      case opt_udev_monitor: uses_udev_monitor = true; break;
+      case opt_benchmark_rate:
+         benchmark_rate = (int)strtoul(optarg, NULL, 0);
+         if (benchmark_rate < 125 || benchmark_rate > 8000)
+         {
+            fprintf(stderr, "argument error: the benchmark rate must be between 125 and 8000 reports per second\n");
+            return -1;
+         }
+         break;
+      case opt_benchmark_sink:
+         if (strcmp(optarg, "null") == 0)
+            benchmark_uses_uinput = false;
+         else if (strcmp(optarg, "uinput") == 0)
+            benchmark_uses_uinput = true;
+         else
+         {
+            fprintf(stderr, "argument error: unknown benchmark sink \"%s\"\n", optarg);
+            return -1;
+         }
+         break;
       case opt_flip_y: flips_y_axis = true; break;
       case opt_unflip_y: flips_y_axis = false; break;
 
@@ -1889,13 +6182,19 @@ int main(int argc, char *argv[])
    }
 
    process_options();
+   setup_personalities();
+   select_translator();
 
-   sa.sa_handler = quitting_signal;
-   sa.sa_flags = SA_RESTART | SA_RESETHAND;
+#ifdef PROFILE_STAGES
+   // profiling builds only, the library installs no signal handlers otherwise
+   struct sigaction sa;
+   memset(&sa, 0, sizeof(sa));
    sigemptyset(&sa.sa_mask);
-
-   sigaction(SIGINT, &sa, NULL);
-   sigaction(SIGTERM, &sa, NULL);
+   sa.sa_handler = profile_signal;
+   sa.sa_flags = SA_RESTART;
+   sigaction(SIGUSR1, &sa, NULL);
+   calibrate_profile_clock();
+#endif
 
    udev = udev_new();
    if (udev == NULL) {
@@ -1903,26 +6202,56 @@ int main(int argc, char *argv[])
       return -1;
    }
 
-   uinput = udev_device_new_from_subsystem_sysname(udev, "misc", "uinput");
-   if (uinput == NULL)
+   if (output_backend != output_backend_none)
    {
-      fprintf(stderr, "uinput creation failed\n");
-      return -1;
+      uinput = udev_device_new_from_subsystem_sysname(udev, "misc", "uinput");
+      if (uinput == NULL)
+      {
+         fprintf(stderr, "uinput creation failed\n");
+         return -1;
+      }
+
+      uinput_path = udev_device_get_devnode(uinput);
+      if (uinput_path == NULL)
+      {
+         fprintf(stderr, "cannot find path to uinput\n");
+         return -1;
+      }
    }
 
-   uinput_path = udev_device_get_devnode(uinput);
-   if (uinput_path == NULL)
-   {
-      fprintf(stderr, "cannot find path to uinput\n");
+   if (benchmark_mode == benchmark_none)
+      start_log_thread();
+
+   if (benchmark_mode == benchmark_none && !open_state_file())
+      return -1;
+   if (stream_socket_path != NULL && benchmark_mode == benchmark_none && !start_stream_thread())
       return -1;
+   if (handoff_socket_path != NULL && benchmark_mode == benchmark_none)
+   {
+      receive_handoff();
+      if (!open_handoff_socket())
+         return -1;
    }
 
    libusb_init(NULL);
 
+   hotplug_capability = benchmark_mode == benchmark_none && !uses_udev_monitor && libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG);
+   // before the enumeration, so that no adapter plugged in meanwhile is missed, handle_usb_uevent() skips the ones found twice
+   if (benchmark_mode == benchmark_none && !hotplug_capability)
+      open_usb_monitor(udev);
+
    struct libusb_device **devices;
 
    int count = libusb_get_device_list(NULL, &devices);
 
+   if (benchmark_mode != benchmark_none)
+   {
+      // gc_run_benchmark() picks the adapter
+      benchmark_devices = devices;
+      benchmark_device_count = count;
+      return GC_OPEN_BENCHMARK;
+   }
+
    for (int i = 0; i < count; i++)
    {
       struct libusb_device_descriptor desc;
@@ -1933,34 +6262,146 @@ int main(int argc, char *argv[])
 
    if (count > 0)
       libusb_free_device_list(devices, 1);
+   release_unclaimed_handoff();
 
-   libusb_hotplug_callback_handle callback;
-
-   int hotplug_capability = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG);
    if (hotplug_capability) {
        int hotplug_ret = libusb_hotplug_register_callback(NULL,
              LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
              0, USB_NINTENDO_VENDOR, USB_ID_PRODUCT,
-             LIBUSB_HOTPLUG_MATCH_ANY, hotplug_callback, NULL, &callback);
+             LIBUSB_HOTPLUG_MATCH_ANY, hotplug_callback, NULL, &hotplug_handle);
 
        if (hotplug_ret != LIBUSB_SUCCESS) {
-           fprintf(stderr, "cannot register hotplug callback, hotplugging not enabled\n");
+           fprintf(stderr, "cannot register hotplug callback, watching uevents instead\n");
            hotplug_capability = 0;
+           open_usb_monitor(udev);
        }
    }
+   return 0;
+}
+
+int gc_run_benchmark()
+{
+   struct libusb_device *first_adapter_device = NULL;
+   for (int i = 0; i < benchmark_device_count && first_adapter_device == NULL; i++)
+   {
+      struct libusb_device_descriptor desc;
+      libusb_get_device_descriptor(benchmark_devices[i], &desc);
+      if (desc.idVendor == USB_NINTENDO_VENDOR && desc.idProduct == USB_ID_PRODUCT)
+         first_adapter_device = benchmark_devices[i];
+   }
 
-   // pump events until shutdown & all helper threads finish cleaning up
-   while (!quitting)
-      libusb_handle_events_completed(NULL, (int *)&quitting);
+   int benchmark_ret = 1;
+   if (benchmark_mode == benchmark_usb && first_adapter_device == NULL)
+      fprintf(stderr, "no adapter found to benchmark\n");
+   else if (benchmark_mode == benchmark_usb)
+      benchmark_ret = run_usb_benchmark(first_adapter_device);
+   else if (benchmark_mode == benchmark_shutdown)
+      benchmark_ret = run_shutdown_benchmark();
+   else if (benchmark_mode == benchmark_adapters_scaling)
+      benchmark_ret = run_adapters_benchmark();
+   else if (benchmark_mode == benchmark_idle)
+      benchmark_ret = run_idle_benchmark();
+   else if (benchmark_mode == benchmark_load)
+      benchmark_ret = run_load_benchmark();
+   else if (benchmark_mode == benchmark_evdev)
+      benchmark_ret = run_evdev_benchmark();
+
+   if (benchmark_device_count > 0)
+      libusb_free_device_list(benchmark_devices, 1);
+   libusb_exit(NULL);
+   if (uinput != NULL)
+      udev_device_unref(uinput);
+   udev_unref(udev);
+   return benchmark_ret;
+}
 
-   while (adapters.next)
-      remove_adapter(adapters.next->device);
+bool gc_dispatch(int timeout)
+{
+   if (quitting || has_handed_off)
+      return false;
+
+   // a signal which hits between the check of quitting and the poll is noticed on the next call at the latest
+   struct timeval timeval = { .tv_sec = timeout / 1000, .tv_usec = timeout % 1000 * 1000 };
+   if (usb_monitor != NULL)
+      handle_events_and_uevents(timeout);
+   else
+      libusb_handle_events_timeout_completed(NULL, &timeval, (int *)&quitting);
+
+#ifdef PROFILE_STAGES
+   if (profile_requested)
+   {
+      profile_requested = 0;
+      print_stage_profile(stderr);
+   }
+#endif
+
+   if (handoff_listen_fd >= 0 && accept_handoff())
+   {
+      has_handed_off = true;
+      return false;
+   }
+
+   if (metrics_file_path != NULL)
+   {
+      int64_t now_ns = clock_ns(CLOCK_MONOTONIC);
+      if (now_ns >= next_metrics_ns)
+      {
+         write_metrics_file();
+         next_metrics_ns = now_ns + metrics_interval * 1000000000LL;
+      }
+   }
+   return !quitting;
+}
+
+void gc_interrupt()
+{
+   quitting = 1;
+}
+
+void gc_close()
+{
+#ifdef PROFILE_STAGES
+   print_stage_profile(stderr);
+#endif
+   remove_all_adapters();
 
    if (hotplug_capability)
-      libusb_hotplug_deregister_callback(NULL, callback);
+      libusb_hotplug_deregister_callback(NULL, hotplug_handle);
+   close_usb_monitor();
 
+   close_handoff_socket(has_handed_off);
+   stop_stream_thread();
+   close_state_file();
+   stop_log_thread();
    libusb_exit(NULL);
-   udev_device_unref(uinput);
+   if (uinput != NULL)
+      udev_device_unref(uinput);
    udev_unref(udev);
-   return 0;
+}
+
+void gc_set_port_callback(gc_port_callback callback, void *user_data)
+{
+   port_callback_data = user_data;
+   port_callback = callback;
+}
+
+void gc_enable_port_reads()
+{
+   reads_ports = true;
+}
+
+bool gc_read_port(int adapter, int port, struct GcPortState *state)
+{
+   if (state_file == NULL || adapter < 0 || adapter >= GC_STATE_MAX_ADAPTERS || port < 0 || port >= GC_STATE_PORTS)
+      return false;
+   return gc_state_read_port(state_file, adapter, port, state);
+}
+
+bool gc_set_rumble(int adapter, int port, bool is_rumbling)
+{
+   if (adapter < 0 || adapter >= GC_STATE_MAX_ADAPTERS || port < 0 || port >= 4)
+      return false;
+   // the adapter thread sends it with its next rumble evaluation
+   __atomic_store_n(&requested_rumble[adapter][port], is_rumbling, __ATOMIC_RELAXED);
+   return true;
 }
@@ -0,0 +1,97 @@
+// See LICENSE for license
+
+// Layout of the state file which wii-u-gc-adapter writes with "--state-file ⟨path⟩".
+// Readers map the file read-only and call gc_state_read_port() whenever they want the latest state of a port.
+// Every port slot is guarded by its own sequence lock, so any number of readers can poll without syscalls and without torn reads.
+//
+// Also the frames which are pushed to the subscribers of "--subscribe-socket ⟨path⟩".
+
+#ifndef WII_U_GC_STATE_H
+#define WII_U_GC_STATE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define GC_STATE_MAGIC 0x53434757u  // "WGCS"
+#define GC_STATE_VERSION 1
+#define GC_STATE_MAX_ADAPTERS 4
+#define GC_STATE_PORTS 4
+
+#define GC_STATE_CACHE_LINE 64
+
+struct GcPortState {
+   uint32_t sequence;      // odd while the slot is being written
+   uint8_t type;           // 0 = no controller, 0x10 = normal, 0x20 = wavebird
+   uint8_t extra_power;    // rumble power is connected
+   uint8_t status;         // status byte as sent by the adapter
+   uint8_t reserved;
+   uint16_t buttons;       // buttons as sent by the adapter (first byte in the high bits)
+   uint8_t axis[6];        // left X, left Y, right X, right Y, L, R as sent by the adapter
+   uint64_t timestamp_ns;  // CLOCK_MONOTONIC_RAW arrival time of the USB report
+} __attribute__((aligned(GC_STATE_CACHE_LINE)));
+
+struct GcAdapterState {
+   uint32_t present;       // 1 while an adapter occupies this slot
+   uint8_t bus_number;
+   uint8_t device_address;
+   struct GcPortState ports[GC_STATE_PORTS];
+} __attribute__((aligned(GC_STATE_CACHE_LINE)));
+
+struct GcStateFile {
+   uint32_t magic;
+   uint32_t version;
+   uint32_t max_adapters;
+   uint32_t ports_per_adapter;
+   uint32_t port_state_size;
+   uint32_t writer_pid;
+   struct GcAdapterState adapters[GC_STATE_MAX_ADAPTERS];
+};
+
+enum GcStreamFrameKind {
+   gc_frame_state = 1,       // buttons, axes or power of a connected port changed
+   gc_frame_connect = 2,     // a controller was plugged in, carries its first state
+   gc_frame_disconnect = 3,  // a controller was unplugged or its adapter removed
+};
+
+/** The subscriber socket is a SOCK_SEQPACKET socket, every packet carries one or more whole frames.
+ *  The sequence number increments by one per frame, a gap means the subscriber was too slow and frames were skipped.
+ *  Right after connecting, a subscriber receives a connect frame for every port that is connected at that moment.
+ */
+struct GcStreamFrame {
+   uint32_t sequence;
+   uint8_t kind;             // enum GcStreamFrameKind
+   uint8_t adapter;          // adapter number, equals its slot in the state file
+   uint8_t port;             // 0 to 3
+   uint8_t type;             // see GcPortState
+   uint16_t buttons;
+   uint8_t axis[6];
+   uint8_t extra_power;
+   uint8_t status;
+   uint8_t reserved[6];
+   uint64_t timestamp_ns;
+};
+
+#define GC_STREAM_MAX_FRAMES_PER_PACKET 64
+
+/** Copies a consistent snapshot of one port into *result. Returns false if the adapter slot is not in use. */
+static inline bool gc_state_read_port(const struct GcStateFile *file, int adapter_index, int port_index, struct GcPortState *result)
+{
+   const struct GcAdapterState *adapter = &file->adapters[adapter_index];
+   const struct GcPortState *port = &adapter->ports[port_index];
+   uint32_t sequence_before, sequence_after;
+
+   if (!__atomic_load_n(&adapter->present, __ATOMIC_ACQUIRE))
+      return false;
+
+   do {
+      sequence_before = __atomic_load_n(&port->sequence, __ATOMIC_ACQUIRE);
+      memcpy(result, (const void*)port, sizeof(*result));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      sequence_after = __atomic_load_n(&port->sequence, __ATOMIC_RELAXED);
+   } while ((sequence_before & 1) || sequence_before != sequence_after);
+
+   return true;
+}
+
+#endif
@@ -0,0 +1,61 @@
+// See LICENSE for license
+
+// In-process API of libwiiugc, the library which the wii-u-gc-adapter binary is built on.
+// Programs like emulators link it to read the ports directly instead of through evdev nodes,
+// which saves a kernel round trip and a context switch per report.
+//
+// There is one driver per process: gc_open() once, gc_dispatch() in a loop, gc_close() once.
+// The adapters are numbered like the slots of the state file, see wii-u-gc-state.h, ports are 0 to 3.
+
+#ifndef WII_U_GC_H
+#define WII_U_GC_H
+
+#include <stdbool.h>
+
+#include "wii-u-gc-state.h"
+
+#define GC_API __attribute__((visibility("default")))
+
+#define GC_OPEN_BENCHMARK 1  // gc_open(): "--benchmark" was given, gc_run_benchmark() runs it
+#define GC_OPEN_HELP 2       // gc_open(): "--help" printed the usage, nothing was opened
+
+/** Called by the adapter threads for every report of a connected port and once with type 0 after its controller left.
+ *  Runs on the report path, so it should only copy the state. The sequence member has no meaning here.
+ */
+typedef void (*gc_port_callback)(void *user_data, int adapter, int port, const struct GcPortState *state);
+
+/** Parses argv like the command line of wii-u-gc-adapter (see "--help"), starts the helper threads and opens the adapters
+ *  which are plugged in. "--no-devices" creates no input devices, the ports are then only read through this API.
+ *  Returns 0 on success, GC_OPEN_BENCHMARK, GC_OPEN_HELP or -1 on errors, invalid options print an error and return -1.
+ */
+GC_API int gc_open(int argc, char *argv[]);
+
+/** Handles hotplug events, the handoff socket and the metrics file for at most timeout milliseconds.
+ *  Returns false once gc_interrupt() was called or another instance took over the adapters, then call gc_close().
+ */
+GC_API bool gc_dispatch(int timeout);
+
+// async-signal-safe, lets gc_dispatch() return false
+GC_API void gc_interrupt(void);
+
+// stops all adapter threads, destroys the input devices and releases the adapters
+GC_API void gc_close(void);
+
+// runs the benchmark selected by the options given to gc_open() and releases everything, returns the exit status
+GC_API int gc_run_benchmark(void);
+
+// call before gc_open(), or with no adapter plugged in
+GC_API void gc_set_port_callback(gc_port_callback callback, void *user_data);
+
+// call before gc_open(), without it the ports are only published for gc_read_port() with "--state-file"
+GC_API void gc_enable_port_reads(void);
+
+// copies the newest state of a port, returns false if no adapter has this number or the ports are not published
+GC_API bool gc_read_port(int adapter, int port, struct GcPortState *state);
+
+/** Rumbles the port until it is turned off or the controller is unplugged, in addition to the force feedback of its device.
+ *  Needs the adapter's extra power cable like every rumble. Returns false if the adapter or port number is out of range.
+ */
+GC_API bool gc_set_rumble(int adapter, int port, bool is_rumbling);
+
+#endif